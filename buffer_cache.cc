@@ -0,0 +1,444 @@
+#include "buffer_cache.h"
+#include "inode_manager.h"
+
+#include <chrono>
+
+#define NSHARDS 16
+
+// Fewest buffers per shard, whatever the budget says.
+#define MIN_SHARD_BUFS 8
+
+buf_ref &buf_ref::operator=(buf_ref &&other)
+{
+  if (this != &other)
+  {
+    release();
+    cache = other.cache;
+    b = other.b;
+    other.b = NULL;
+  }
+  return *this;
+}
+
+void buf_ref::mark_dirty()
+{
+  cache->mark_dirty(b);
+}
+
+void buf_ref::release()
+{
+  if (b != NULL)
+  {
+    cache->unpin(b);
+    b = NULL;
+  }
+}
+
+buffer_cache::buffer_cache(disk *d, uint32_t block_size, size_t budget, int flush_ms)
+  : d(d), block_size(block_size), nshards(NSHARDS),
+    hits(0), misses(0), evictions(0), writebacks(0), prefetched(0),
+    flush_ms(flush_ms), stopping(false), logging(false)
+{
+  shards = new shard[nshards];
+  size_t per_shard = budget / block_size / nshards;
+  for (uint32_t i = 0; i < nshards; ++i)
+  {
+    shards[i].hand = 0;
+    shards[i].capacity = per_shard < MIN_SHARD_BUFS ? MIN_SHARD_BUFS : per_shard;
+  }
+  if (flush_ms > 0)
+  {
+    flusher = std::thread(&buffer_cache::flush_loop, this);
+  }
+}
+
+buffer_cache::~buffer_cache()
+{
+  {
+    std::lock_guard<std::mutex> lock(flush_m);
+    stopping = true;
+  }
+  flush_cv.notify_all();
+  if (flusher.joinable())
+  {
+    flusher.join();
+  }
+  flush();
+  for (uint32_t i = 0; i < nshards; ++i)
+  {
+    for (size_t j = 0; j < shards[i].frames.size(); ++j)
+    {
+      delete[] shards[i].frames[j]->data;
+      delete shards[i].frames[j];
+    }
+  }
+  delete[] shards;
+}
+
+// Find a buffer that can be reused, writing it back if dirty; one the
+// disk has no room for stays. Called with s.m held. Return NULL if every
+// buffer is pinned.
+struct buf *
+buffer_cache::evict(shard &s)
+{
+  for (size_t n = 0; n < 2 * s.frames.size(); ++n)
+  {
+    struct buf *b = s.frames[s.hand];
+    s.hand = (s.hand + 1) % s.frames.size();
+    if (b->pins > 0)
+    {
+      continue;
+    }
+    if (b->referenced)
+    {
+      b->referenced = false;
+      continue;
+    }
+    if (b->dirty)
+    {
+      if (!d->write_block(b->id, b->data))
+      {
+        continue;
+      }
+      ++writebacks;
+    }
+    s.map.erase(b->id);
+    ++evictions;
+    return b;
+  }
+  return NULL;
+}
+
+// A free buffer for s, evicting one or growing. Called with s.m held.
+struct buf *
+buffer_cache::frame(shard &s)
+{
+  struct buf *b = NULL;
+  if (s.frames.size() >= s.capacity)
+  {
+    b = evict(s);
+  }
+  if (b == NULL)
+  {
+    // under budget, or everything is pinned: grow
+    b = new struct buf;
+    b->data = new char[block_size];
+    s.frames.push_back(b);
+  }
+  return b;
+}
+
+// Return block id pinned. Its contents are replaced by fill if that is
+// set, else read from disk on a miss. Either happens before the lock is
+// dropped, so nobody else sees the buffer half filled.
+struct buf *
+buffer_cache::lookup(uint32_t id, const char *fill)
+{
+  shard &s = shard_of(id);
+  std::lock_guard<std::mutex> lock(s.m);
+
+  std::unordered_map<uint32_t, struct buf *>::iterator it = s.map.find(id);
+  if (it != s.map.end())
+  {
+    ++hits;
+    it->second->pins++;
+    it->second->referenced = true;
+    if (fill != NULL)
+    {
+      memcpy(it->second->data, fill, block_size);
+    }
+    return it->second;
+  }
+
+  ++misses;
+  struct buf *b = frame(s);
+  b->id = id;
+  b->pins = 1;
+  b->dirty = false;
+  b->referenced = true;
+  b->logged = false;
+  if (fill != NULL)
+  {
+    memcpy(b->data, fill, block_size);
+  }
+  else
+  {
+    d->read_block(id, b->data);
+  }
+  s.map[id] = b;
+  return b;
+}
+
+buf_ref buffer_cache::get(uint32_t id)
+{
+  return buf_ref(this, lookup(id, NULL));
+}
+
+// Pin block id only if it is already in the cache; the handle is empty
+// otherwise. Nothing is read from disk.
+buf_ref buffer_cache::get_resident(uint32_t id)
+{
+  shard &s = shard_of(id);
+  std::lock_guard<std::mutex> lock(s.m);
+  struct buf *b = find(s, id);
+  if (b == NULL)
+  {
+    return buf_ref();
+  }
+  ++hits;
+  b->pins++;
+  b->referenced = true;
+  return buf_ref(this, b);
+}
+
+void buffer_cache::read(uint32_t id, char *out)
+{
+  struct buf *b = lookup(id, NULL);
+  memcpy(out, b->data, block_size);
+  unpin(b);
+}
+
+// Bring n blocks into the cache ahead of use. The missing ones are read
+// in one batch and put in unreferenced, so they are the first to go if
+// nobody wants them after all. The caller keeps the blocks from being
+// written meanwhile.
+void buffer_cache::prefetch(const uint32_t *ids, uint32_t n)
+{
+  std::vector<uint32_t> missing;
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    shard &s = shard_of(ids[i]);
+    std::lock_guard<std::mutex> lock(s.m);
+    if (find(s, ids[i]) == NULL)
+    {
+      missing.push_back(ids[i]);
+    }
+  }
+  if (missing.empty())
+  {
+    return;
+  }
+
+  std::vector<char> data(missing.size() * block_size);
+  io_batch batch;
+  for (size_t i = 0, run; i < missing.size(); i += run)
+  {
+    for (run = 1; i + run < missing.size() && missing[i + run] == missing[i] + run; ++run)
+    {
+    }
+    batch.read(missing[i], run, data.data() + i * block_size);
+  }
+  d->submit(batch);
+  d->complete(batch);
+
+  for (size_t i = 0; i < missing.size(); ++i)
+  {
+    shard &s = shard_of(missing[i]);
+    std::lock_guard<std::mutex> lock(s.m);
+    if (find(s, missing[i]) != NULL)
+    {
+      // read in meanwhile
+      continue;
+    }
+    struct buf *b = frame(s);
+    b->id = missing[i];
+    b->pins = 0;
+    b->dirty = false;
+    b->referenced = false;
+    b->logged = false;
+    memcpy(b->data, data.data() + i * block_size, block_size);
+    s.map[b->id] = b;
+    ++prefetched;
+  }
+}
+
+// Overwrite a whole block. A miss does not need to read the old contents.
+void buffer_cache::write(uint32_t id, const char *in)
+{
+  struct buf *b = lookup(id, in);
+  mark_dirty(b);
+  unpin(b);
+}
+
+// Return the resident buffer for id, if any. Called with s.m held.
+struct buf *
+buffer_cache::find(shard &s, uint32_t id)
+{
+  std::unordered_map<uint32_t, struct buf *>::iterator it = s.map.find(id);
+  return it == s.map.end() ? NULL : it->second;
+}
+
+// Read n consecutive blocks straight from the disk, then lay any resident
+// buffers, which may be newer, over the copy. The range is not brought
+// into the cache, so a large sequential read does not flush it.
+void buffer_cache::read_range(uint32_t id, uint32_t n, char *out)
+{
+  d->read_range(id, n, out);
+  overlay(id, n, out);
+}
+
+// Write n consecutive blocks straight to the disk, refreshing any resident
+// copies so the cache never holds stale data. Return false if the disk
+// had no room for them.
+bool buffer_cache::write_range(uint32_t id, uint32_t n, const char *in)
+{
+  refresh(id, n, in);
+  return d->write_range(id, n, in);
+}
+
+// Like read_range and write_range for every request of b, with all of
+// them in flight at once. The reads are only done after complete.
+void buffer_cache::submit(io_batch &b)
+{
+  for (size_t i = 0; i < b.reqs.size(); ++i)
+  {
+    if (b.reqs[i].write)
+    {
+      refresh(b.reqs[i].id, b.reqs[i].n, b.reqs[i].buf);
+    }
+  }
+  d->submit(b);
+}
+
+bool buffer_cache::complete(io_batch &b)
+{
+  bool ok = d->complete(b);
+  for (size_t i = 0; i < b.reqs.size(); ++i)
+  {
+    if (!b.reqs[i].write)
+    {
+      overlay(b.reqs[i].id, b.reqs[i].n, b.reqs[i].buf);
+    }
+  }
+  return ok;
+}
+
+// Copy the resident buffers among n blocks from id on over out.
+void buffer_cache::overlay(uint32_t id, uint32_t n, char *out)
+{
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    shard &s = shard_of(id + i);
+    std::lock_guard<std::mutex> lock(s.m);
+    struct buf *b = find(s, id + i);
+    if (b != NULL)
+    {
+      memcpy(out + (size_t)i * block_size, b->data, block_size);
+      ++hits;
+    }
+  }
+}
+
+// Copy in over the resident buffers among n blocks from id on.
+void buffer_cache::refresh(uint32_t id, uint32_t n, const char *in)
+{
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    shard &s = shard_of(id + i);
+    std::lock_guard<std::mutex> lock(s.m);
+    struct buf *b = find(s, id + i);
+    if (b != NULL)
+    {
+      memcpy(b->data, in + (size_t)i * block_size, block_size);
+    }
+  }
+}
+
+void buffer_cache::mark_dirty(struct buf *b)
+{
+  std::lock_guard<std::mutex> lock(shard_of(b->id).m);
+  b->dirty = true;
+  if (logging && !b->logged)
+  {
+    b->logged = true;
+    b->pins++;
+    std::lock_guard<std::mutex> txn_lock(txn_m);
+    txn.push_back(b);
+  }
+}
+
+// Number of buffers in the running transaction.
+size_t buffer_cache::logged()
+{
+  std::lock_guard<std::mutex> lock(txn_m);
+  return txn.size();
+}
+
+// Hand the running transaction's buffers to the journal to commit.
+void buffer_cache::take_logged(std::vector<struct buf *> &bufs)
+{
+  std::lock_guard<std::mutex> lock(txn_m);
+  bufs.swap(txn);
+  txn.clear();
+}
+
+// The journal has written b to its home location: it is clean and may
+// be evicted again.
+void buffer_cache::installed(struct buf *b)
+{
+  std::lock_guard<std::mutex> lock(shard_of(b->id).m);
+  b->logged = false;
+  b->dirty = false;
+  b->pins--;
+}
+
+void buffer_cache::unpin(struct buf *b)
+{
+  std::lock_guard<std::mutex> lock(shard_of(b->id).m);
+  b->pins--;
+}
+
+// Write every dirty buffer back to disk, except those the journal holds.
+// One the disk has no room for stays dirty.
+void buffer_cache::flush()
+{
+  for (uint32_t i = 0; i < nshards; ++i)
+  {
+    std::lock_guard<std::mutex> lock(shards[i].m);
+    for (size_t j = 0; j < shards[i].frames.size(); ++j)
+    {
+      struct buf *b = shards[i].frames[j];
+      if (b->dirty && !b->logged && d->write_block(b->id, b->data))
+      {
+        b->dirty = false;
+        ++writebacks;
+      }
+    }
+  }
+}
+
+void buffer_cache::flush_loop()
+{
+  std::unique_lock<std::mutex> lock(flush_m);
+  while (!stopping)
+  {
+    flush_cv.wait_for(lock, std::chrono::milliseconds(flush_ms));
+    if (stopping)
+    {
+      break;
+    }
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
+
+void buffer_cache::get_stats(cache_stats &st)
+{
+  st.hits = hits;
+  st.misses = misses;
+  st.evictions = evictions;
+  st.writebacks = writebacks;
+  st.prefetched = prefetched;
+  st.resident = 0;
+  st.dirty = 0;
+  for (uint32_t i = 0; i < nshards; ++i)
+  {
+    std::lock_guard<std::mutex> lock(shards[i].m);
+    st.resident += shards[i].map.size();
+    for (size_t j = 0; j < shards[i].frames.size(); ++j)
+    {
+      st.dirty += shards[i].frames[j]->dirty;
+    }
+  }
+}
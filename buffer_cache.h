@@ -0,0 +1,142 @@
+// block buffer cache interface.
+
+#ifndef buffer_cache_h
+#define buffer_cache_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class disk;
+class io_batch;
+
+typedef struct buf
+{
+  uint32_t id;
+  char *data;
+  int pins;        // live buf_refs; a pinned buffer is never evicted
+  bool dirty;      // newer than the disk
+  bool referenced; // CLOCK bit
+  bool logged;     // in the running transaction, pinned until it commits
+} buf_t;
+
+class buffer_cache;
+
+// A pinned cached block. While the handle lives the buffer stays at the
+// same address, so data() can be read or written in place. Call
+// mark_dirty() after changing it.
+class buf_ref
+{
+private:
+  buffer_cache *cache;
+  struct buf *b;
+
+public:
+  buf_ref() : cache(NULL), b(NULL) {}
+  buf_ref(buffer_cache *c, struct buf *b) : cache(c), b(b) {}
+  buf_ref(buf_ref &&other) : cache(other.cache), b(other.b) { other.b = NULL; }
+  buf_ref &operator=(buf_ref &&other);
+  buf_ref(const buf_ref &) = delete;
+  buf_ref &operator=(const buf_ref &) = delete;
+  ~buf_ref() { release(); }
+
+  explicit operator bool() const { return b != NULL; }
+  char *data() const { return b->data; }
+  uint32_t id() const { return b->id; }
+  void mark_dirty();
+  void release();
+};
+
+typedef struct cache_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;
+  uint64_t prefetched; // blocks read in ahead of use
+  uint64_t resident; // buffers in memory
+  uint64_t dirty;
+} cache_stats_t;
+
+// Write-back cache of disk blocks. Blocks are spread over shards, each
+// with its own lock, lookup table and CLOCK ring, so lookups of
+// unrelated blocks do not contend. The total number of buffers is bounded
+// by the memory budget; dirty buffers are written back when they are
+// evicted, by the background flusher every flush_ms, or by flush().
+// Buffers in a journal transaction stay pinned until it commits; the
+// journal keeps transactions within budget() so they cannot crowd out
+// everything else.
+class buffer_cache
+{
+private:
+  struct shard
+  {
+    std::mutex m;
+    std::unordered_map<uint32_t, struct buf *> map;
+    std::vector<struct buf *> frames; // CLOCK ring
+    size_t hand;
+    size_t capacity;
+  };
+
+  disk *d;
+  uint32_t block_size;
+  uint32_t nshards;
+  shard *shards;
+
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+  std::atomic<uint64_t> writebacks;
+  std::atomic<uint64_t> prefetched;
+
+  int flush_ms;
+  bool stopping;
+  std::mutex flush_m;
+  std::condition_variable flush_cv;
+  std::thread flusher;
+
+  bool logging;
+  std::mutex txn_m;
+  std::vector<struct buf *> txn; // logged buffers
+
+  shard &shard_of(uint32_t id) { return shards[id % nshards]; }
+  struct buf *find(shard &s, uint32_t id);
+  struct buf *lookup(uint32_t id, const char *fill);
+  struct buf *evict(shard &s);
+  struct buf *frame(shard &s);
+  void overlay(uint32_t id, uint32_t n, char *out);
+  void refresh(uint32_t id, uint32_t n, const char *in);
+  void flush_loop();
+
+public:
+  buffer_cache(disk *d, uint32_t block_size, size_t budget, int flush_ms);
+  ~buffer_cache();
+
+  buf_ref get(uint32_t id);
+  buf_ref get_resident(uint32_t id);
+  void read(uint32_t id, char *out);
+  void write(uint32_t id, const char *in);
+  void read_range(uint32_t id, uint32_t n, char *out);
+  bool write_range(uint32_t id, uint32_t n, const char *in);
+  void submit(io_batch &b);
+  bool complete(io_batch &b);
+  void prefetch(const uint32_t *ids, uint32_t n);
+  void flush();
+  void get_stats(cache_stats &st);
+  void set_logging(bool on) { logging = on; }
+  size_t budget() const { return (size_t)nshards * shards[0].capacity; }
+  size_t logged();
+  void take_logged(std::vector<struct buf *> &bufs);
+  void installed(struct buf *b);
+
+  void mark_dirty(struct buf *b);
+  void unpin(struct buf *b);
+};
+
+#endif
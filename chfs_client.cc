@@ -13,17 +13,31 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 chfs_client::chfs_client()
+    : dgen(0), agen(0), attr_ttl_ms(ATTR_TTL_MS), ra_stopping(false)
 {
     ec = new extent_client();
-
+    ra_thread = std::thread(&chfs_client::ra_loop, this);
 }
 
 chfs_client::chfs_client(std::string extent_dst, std::string lock_dst)
+    : dgen(0), agen(0), attr_ttl_ms(ATTR_TTL_MS), ra_stopping(false)
 {
     ec = new extent_client();
     std::cout << "Ini ChFS Client" << std::endl;
     if (ec->put(1, "") != extent_protocol::OK)
         printf("error init root dir\n"); // XYB: init root dir
+    ra_thread = std::thread(&chfs_client::ra_loop, this);
+}
+
+chfs_client::~chfs_client()
+{
+    {
+        std::lock_guard<std::mutex> lock(ra_m);
+        ra_stopping = true;
+    }
+    ra_cv.notify_all();
+    ra_thread.join();
+    delete ec;
 }
 
 chfs_client::inum
@@ -43,12 +57,184 @@ chfs_client::filename(inum inum)
     return ost.str();
 }
 
+// Key of name in directory parent: the parent's inum bytes, then the name.
+std::string
+chfs_client::dkey(inum parent, const char *name)
+{
+    std::string key((const char *)&parent, sizeof(parent));
+    key += name;
+    return key;
+}
+
+// Look name up in the cache. On a miss, gen is set for dcache_fill.
 bool
-chfs_client::isfile(inum inum)
+chfs_client::dcache_get(inum parent, const char *name, inum &ino, uint64_t &gen)
 {
-    extent_protocol::attr a;
+    std::lock_guard<std::mutex> lock(dcache_m);
+    std::unordered_map<std::string, std::list<dentry>::iterator>::iterator it = dcache.find(dkey(parent, name));
+    if (it == dcache.end())
+    {
+        gen = dgen;
+        return false;
+    }
+    dlru.splice(dlru.begin(), dlru, it->second);
+    ino = it->second->ino;
+    return true;
+}
+
+// Cache what the server said about name after a miss at generation gen.
+void
+chfs_client::dcache_fill(inum parent, const char *name, inum ino, uint64_t gen)
+{
+    std::lock_guard<std::mutex> lock(dcache_m);
+    if (gen == dgen)
+    {
+        dcache_insert(dkey(parent, name), parent, ino);
+    }
+}
+
+// Record a change this client made: name in parent is now ino, or is
+// gone if ino is 0.
+void
+chfs_client::dcache_put(inum parent, const char *name, inum ino)
+{
+    std::lock_guard<std::mutex> lock(dcache_m);
+    ++dgen;
+    dcache_insert(dkey(parent, name), parent, ino);
+}
+
+// Add or update a name, with dcache_m held. The least recently used name
+// goes once the cache is full.
+void
+chfs_client::dcache_insert(const std::string &key, inum parent, inum ino)
+{
+    std::unordered_map<std::string, std::list<dentry>::iterator>::iterator it = dcache.find(key);
+    if (it != dcache.end())
+    {
+        it->second->ino = ino;
+        dlru.splice(dlru.begin(), dlru, it->second);
+        return;
+    }
+    dlru.push_front(dentry{key, parent, ino});
+    dcache[key] = dlru.begin();
+    dparents[parent]++;
+    if (dcache.size() > DCACHE_SIZE)
+    {
+        dentry &old = dlru.back();
+        dcache.erase(old.key);
+        if (--dparents[old.parent] == 0)
+        {
+            dparents.erase(old.parent);
+        }
+        dlru.pop_back();
+    }
+}
+
+// Forget the names cached under dir. Called when its inum is handed out
+// again, so names from a removed directory cannot leak into the new one.
+void
+chfs_client::dcache_purge(inum dir)
+{
+    std::lock_guard<std::mutex> lock(dcache_m);
+    ++dgen;
+    if (dparents.erase(dir) == 0)
+    {
+        return;
+    }
+    for (std::list<dentry>::iterator it = dlru.begin(); it != dlru.end(); )
+    {
+        if (it->parent == dir)
+        {
+            dcache.erase(it->key);
+            it = dlru.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
 
+// Type and attributes of inum in one call. They are served from the
+// attribute cache for up to attr_ttl_ms after being fetched; this
+// client's own changes drop them sooner.
+int
+chfs_client::stat(inum inum, statinfo &st)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint64_t gen;
+    {
+        std::lock_guard<std::mutex> lock(acache_m);
+        std::unordered_map<chfs_client::inum, std::list<cached_attr>::iterator>::iterator it = acache.find(inum);
+        if (it != acache.end() && now < it->second->expires)
+        {
+            st = it->second->st;
+            alru.splice(alru.begin(), alru, it->second);
+            return OK;
+        }
+        gen = agen;
+    }
+
+    extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
+        printf("error getting attr\n");
+        return IOERR;
+    }
+    if (a.type == 0)
+    {
+        return NOENT;
+    }
+    st.type = a.type;
+    st.size = a.size;
+    st.atime = a.atime;
+    st.mtime = a.mtime;
+    st.ctime = a.ctime;
+
+    std::lock_guard<std::mutex> lock(acache_m);
+    if (gen != agen)
+    {
+        // changed meanwhile; what was fetched may already be stale
+        return OK;
+    }
+    // as with names, the least recently used goes once the cache is full
+    std::chrono::steady_clock::time_point expires = now + std::chrono::milliseconds(attr_ttl_ms);
+    std::unordered_map<chfs_client::inum, std::list<cached_attr>::iterator>::iterator it = acache.find(inum);
+    if (it != acache.end())
+    {
+        it->second->st = st;
+        it->second->expires = expires;
+        alru.splice(alru.begin(), alru, it->second);
+        return OK;
+    }
+    alru.push_front(cached_attr{inum, st, expires});
+    acache[inum] = alru.begin();
+    if (acache.size() > ACACHE_SIZE)
+    {
+        acache.erase(alru.back().ino);
+        alru.pop_back();
+    }
+    return OK;
+}
+
+void
+chfs_client::attr_drop(inum inum)
+{
+    std::lock_guard<std::mutex> lock(acache_m);
+    ++agen;
+    std::unordered_map<chfs_client::inum, std::list<cached_attr>::iterator>::iterator it = acache.find(inum);
+    if (it != acache.end())
+    {
+        alru.erase(it->second);
+        acache.erase(it);
+    }
+}
+
+bool
+chfs_client::isfile(inum inum)
+{
+    statinfo a;
+
+    if (stat(inum, a) != OK) {
         printf("error getting attr\n");
         return false;
     }
@@ -69,9 +255,9 @@ bool
 chfs_client::isdir(inum inum)
 {
     // Oops! is this still correct when you implement symlink?
-    extent_protocol::attr a;
+    statinfo a;
 
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
+    if (stat(inum, a) != OK) {
         printf("error getting attr\n");
         return false;
     }
@@ -89,8 +275,8 @@ chfs_client::getfile(inum inum, fileinfo &fin)
     int r = OK;
 
     printf("getfile %016llx\n", inum);
-    extent_protocol::attr a;
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
+    statinfo a;
+    if (stat(inum, a) != OK) {
         r = IOERR;
         goto release;
     }
@@ -111,8 +297,8 @@ chfs_client::getdir(inum inum, dirinfo &din)
     int r = OK;
 
     printf("getdir %016llx\n", inum);
-    extent_protocol::attr a;
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
+    statinfo a;
+    if (stat(inum, a) != OK) {
         r = IOERR;
         goto release;
     }
@@ -145,11 +331,38 @@ chfs_client::setattr(inum ino, size_t size)
      * according to the size (<, =, or >) content length.
      */
     r = ec->set_attr(ino, size);
+    attr_drop(ino);
     
 
     return r;
 }
 
+// Create an inode of type as name in parent. The existence check,
+// allocation and directory entry are one call to the extent server.
+int
+chfs_client::create_in(inum parent, const char *name, uint32_t type, inum &ino_out)
+{
+    extent_protocol::status ret = ec->create_in(parent, std::string(name), type, ino_out);
+    if (ret == extent_protocol::EXIST)
+    {
+        dcache_put(parent, name, ino_out);
+        return EXIST;
+    }
+    if (ret == extent_protocol::NOSPC)
+    {
+        return NOSPC;
+    }
+    if (ret != extent_protocol::OK)
+    {
+        return IOERR;
+    }
+    dcache_purge(ino_out);
+    dcache_put(parent, name, ino_out);
+    attr_drop(parent);
+    attr_drop(ino_out);
+    return OK;
+}
+
 int
 chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
@@ -160,17 +373,9 @@ chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
      * note: lookup is what you need to check if file exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
-    bool file_exist = false;
-    inum lookup_ino = ino_out;
-    lookup(parent, name, file_exist, lookup_ino);
-    if (file_exist)
+    r = create_in(parent, name, extent_protocol::T_FILE, ino_out);
+    if (r == OK)
     {
-        r = EXIST;
-    }
-    else
-    {
-        r = ec->create(extent_protocol::T_FILE, ino_out);
-        ec->add_to_dir(parent, ino_out, std::string(name));
         std::cout << "chfs_client : create " << name << " with ino " << ino_out << std::endl;
     }
     return r;
@@ -186,17 +391,9 @@ chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
      * note: lookup is what you need to check if directory exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
-    bool dir_exist = false;
-    inum lookup_ino = ino_out;
-    lookup(parent, name, dir_exist, lookup_ino);
-    if (dir_exist)
-    {
-        r = EXIST;
-    }
-    else
+    r = create_in(parent, name, extent_protocol::T_DIR, ino_out);
+    if (r == OK)
     {
-        r = ec->create(extent_protocol::T_DIR, ino_out);
-        ec->add_to_dir(parent, ino_out, std::string(name));
         std::cout << "chfs_client : create " << name << " with ino " << ino_out << std::endl;
     }
     return r;
@@ -212,18 +409,7 @@ int r = OK;
      * note: lookup is what you need to check if directory exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
-    bool link_exist = false;
-    inum lookup_ino = ino_out;
-    lookup(parent, name, link_exist, lookup_ino);
-    if (link_exist)
-    {
-        r = EXIST;
-    }
-    else
-    {
-        r = ec->create(extent_protocol::T_LNK, ino_out);
-        ec->add_to_dir(parent, ino_out, std::string(name));
-    }
+    r = create_in(parent, name, extent_protocol::T_LNK, ino_out);
     return r;
 }
 
@@ -237,17 +423,20 @@ chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
      * note: lookup file from parent dir according to name;
      * you should design the format of directory content.
      */
-    std::list<dirent> contents;
-    readdir(parent, contents);
-    for (auto content : contents)
+    inum ino = 0;
+    uint64_t gen;
+    if (!dcache_get(parent, name, ino, gen))
     {
-        // printf("chfs_client: find dir %s\n", content.name.c_str());
-        if (std::string(name) == content.name)
+        if (ec->lookup(parent, std::string(name), ino) != extent_protocol::OK)
         {
-            found = true;
-            ino_out = content.inum;
-            break;
+            return IOERR;
         }
+        dcache_fill(parent, name, ino, gen);
+    }
+    found = ino != 0;
+    if (found)
+    {
+        ino_out = ino;
     }
 
     return r;
@@ -284,25 +473,119 @@ chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
      * your code goes here.
      * note: read using ec->get().
      */
-    std::string read_str;
-    ec->get(ino, read_str);
-    uint32_t read_str_size = read_str.size();
-    if (read_str_size < off)
+    // only the blocks covering [off, off + size) are read
+    if (ec->read(ino, off, size, data) != extent_protocol::OK)
     {
-        data = "";
+        r = IOERR;
     }
-    else if (read_str_size < off + size)
+
+    return r;
+}
+
+// Read without copying: v gets views of the data, which stay valid while
+// v lives. fh is the handle open returned, or 0 for no readahead.
+int
+chfs_client::read(inum ino, size_t size, off_t off, file_view &v, uint64_t fh)
+{
+    int r = OK;
+
+    if (ec->read_view(ino, off, size, v) != extent_protocol::OK)
     {
-        data = read_str.substr(off);
+        r = IOERR;
     }
-    else
+    else if (fh != 0 && v.bytes > 0)
     {
-        data = read_str.substr(off, size);
+        readahead((stream *)fh, ino, off, v.bytes, v.size);
     }
-
     return r;
 }
 
+// Start tracking reads of an open file; the handle goes to read and
+// release.
+uint64_t
+chfs_client::open(inum ino)
+{
+    stream *s = new stream;
+    s->next = -1; // no read yet
+    s->ahead = 0;
+    s->window = 0;
+    return (uint64_t)s;
+}
+
+void
+chfs_client::release(uint64_t fh)
+{
+    delete (stream *)fh;
+}
+
+// Note a read of len bytes at off in a file of size bytes. Once a read
+// follows on from the one before, keep a window ahead of them in the
+// cache: when the reader gets within half a window of what was
+// prefetched, prefetch the next window, twice as big, stopping at the end
+// of the file. A read elsewhere starts over. Reads served a little out of
+// order by concurrent FUSE threads still count as sequential.
+void
+chfs_client::readahead(stream *s, inum ino, off_t off, size_t len, uint64_t size)
+{
+    off_t end = off + len;
+    prefetch_req req;
+    {
+        std::lock_guard<std::mutex> lock(s->m);
+        bool sequential = off == s->next ||
+            (s->window > 0 && off >= s->next - (off_t)s->window && off < s->ahead);
+        if (!sequential)
+        {
+            s->window = 0;
+            s->next = end;
+            s->ahead = end;
+            return;
+        }
+        s->next = std::max(s->next, end);
+        s->ahead = std::max(s->ahead, end);
+        if (s->ahead - end > (off_t)s->window / 2 || (uint64_t)s->ahead >= size)
+        {
+            return;
+        }
+        s->window = s->window == 0 ? RA_MIN_WINDOW : MIN(s->window * 2, RA_MAX_WINDOW);
+        req.ino = ino;
+        req.off = s->ahead;
+        req.len = MIN((uint64_t)s->window, size - s->ahead);
+        s->ahead += req.len;
+    }
+    {
+        std::lock_guard<std::mutex> lock(ra_m);
+        if (ra_queue.size() >= RA_QUEUE)
+        {
+            return;
+        }
+        ra_queue.push_back(req);
+    }
+    ra_cv.notify_one();
+}
+
+// Carry out queued prefetches, off the readers' path.
+void
+chfs_client::ra_loop()
+{
+    std::unique_lock<std::mutex> lock(ra_m);
+    while (true)
+    {
+        while (ra_queue.empty() && !ra_stopping)
+        {
+            ra_cv.wait(lock);
+        }
+        if (ra_stopping)
+        {
+            return;
+        }
+        prefetch_req req = ra_queue.front();
+        ra_queue.pop_front();
+        lock.unlock();
+        ec->prefetch(req.ino, req.off, req.len);
+        lock.lock();
+    }
+}
+
 int
 chfs_client::write(inum ino, size_t size, off_t off, const char *data,
         size_t &bytes_written)
@@ -314,18 +597,22 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
      * note: write using ec->put().
      * when off > length of original file, fill the holes with '\0'.
      */
-    std::string read_str;
-    ec->get(ino, read_str);
-    setattr(ino, 0);
-    if (off + size > read_str.size())
+    // blocks under the range are overwritten in place; a gap past the
+    // old end reads back as zeros
+    extent_protocol::status ret = ec->write(ino, off, std::string(data, size));
+    attr_drop(ino);
+    if (ret == extent_protocol::FBIG)
+    {
+        return FBIG;
+    }
+    if (ret == extent_protocol::NOSPC)
     {
-        read_str.resize(off + size);
+        return NOSPC;
     }
-    for (uint32_t i = off; i < off + size; ++i)
+    if (ret != extent_protocol::OK)
     {
-        read_str[i] = data[i - off];
+        return IOERR;
     }
-    ec->put(ino, read_str);
     bytes_written = size;
     return r;
 }
@@ -339,17 +626,27 @@ int chfs_client::unlink(inum parent, const char *name)
      * note: you should remove the file using ec->remove,
      * and update the parent directory content.
      */
-    std::list<dirent> files;
-    readdir(parent, files);
-    for (auto file : files)
+    inum ino = 0;
+    extent_protocol::status ret = ec->unlink(parent, std::string(name), ino);
+    if (ret == extent_protocol::NOENT)
     {
-        if (file.name == std::string(name))
-        {
-            ec->remove(file.inum);
-            ec->remove_from_dir(parent, file.inum);
-            break;
-        }
+        r = NOENT;
+    }
+    else if (ret == extent_protocol::NOTEMPTY)
+    {
+        return NOTEMPTY;
+    }
+    else if (ret == extent_protocol::NOSPC)
+    {
+        return NOSPC;
+    }
+    else if (ret != extent_protocol::OK)
+    {
+        return IOERR;
     }
+    dcache_put(parent, name, 0);
+    attr_drop(parent);
+    attr_drop(ino);
 
     return r;
 }
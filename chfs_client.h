@@ -4,15 +4,36 @@
 #include <string>
 //#include "chfs_protocol.h"
 #include "extent_client.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+// Names resolved recently, found or not, kept by chfs_client.
+#define DCACHE_SIZE 8192
+
+// How long chfs_client trusts attributes it has fetched, and how many it
+// keeps.
+#define ATTR_TTL_MS 1000
+#define ACACHE_SIZE 8192
+
+// Readahead window of a file read sequentially: it starts at
+// RA_MIN_WINDOW bytes and doubles with every prefetch, up to
+// RA_MAX_WINDOW. At most RA_QUEUE prefetches wait to be done.
+#define RA_MIN_WINDOW (64 * 1024)
+#define RA_MAX_WINDOW (1024 * 1024)
+#define RA_QUEUE 64
 
 class chfs_client {
   extent_client *ec;
  public:
 
   typedef unsigned long long inum;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, FBIG, NOSPC, NOTEMPTY };
   typedef int status;
 
   struct fileinfo {
@@ -26,19 +47,84 @@ class chfs_client {
     unsigned long mtime;
     unsigned long ctime;
   };
+  struct statinfo {
+    uint32_t type; // extent_protocol::types
+    unsigned long long size;
+    unsigned long atime;
+    unsigned long mtime;
+    unsigned long ctime;
+  };
   struct dirent {
     std::string name;
     chfs_client::inum inum;
   };
 
  private:
+  // A cached name in a directory; ino is 0 for a name known not to exist.
+  struct dentry {
+    std::string key;
+    inum parent;
+    inum ino;
+  };
+  std::list<dentry> dlru; // most recently used first
+  std::unordered_map<std::string, std::list<dentry>::iterator> dcache;
+  std::unordered_map<inum, uint32_t> dparents; // cached names per directory
+  // Each cache has a generation, bumped by every change this client
+  // makes. A miss notes it, and the fetched value is only cached if no
+  // change has happened meanwhile, so a racing update is never undone.
+  std::mutex dcache_m;
+  uint64_t dgen;
+
+  struct cached_attr {
+    inum ino;
+    statinfo st;
+    std::chrono::steady_clock::time_point expires;
+  };
+  std::list<cached_attr> alru; // most recently used first
+  std::unordered_map<inum, std::list<cached_attr>::iterator> acache;
+  std::mutex acache_m;
+  uint64_t agen;
+  int attr_ttl_ms;
+
   static std::string filename(inum);
   static inum n2i(std::string);
+  static std::string dkey(inum, const char *);
+  bool dcache_get(inum, const char *, inum &, uint64_t &);
+  void dcache_fill(inum, const char *, inum, uint64_t);
+  void dcache_put(inum, const char *, inum);
+  void dcache_insert(const std::string &, inum, inum);
+  void dcache_purge(inum);
+  int create_in(inum, const char *, uint32_t, inum &);
+  void attr_drop(inum);
+
+  // Sequential read detection for one open file.
+  struct stream {
+    std::mutex m;
+    off_t next;      // where the next read starts if reads are sequential,
+                     // -1 before the first
+    off_t ahead;     // prefetched up to here
+    uint32_t window; // 0 until the reads look sequential
+  };
+  struct prefetch_req {
+    inum ino;
+    off_t off;
+    uint32_t len;
+  };
+  std::deque<prefetch_req> ra_queue;
+  std::mutex ra_m;
+  std::condition_variable ra_cv;
+  bool ra_stopping;
+  std::thread ra_thread;
+
+  void readahead(stream *, inum, off_t, size_t, uint64_t);
+  void ra_loop();
 
  public:
   chfs_client();
   chfs_client(std::string, std::string);
+  ~chfs_client();
 
+  int stat(inum, statinfo &);
   bool isfile(inum);
   bool isdir(inum);
 
@@ -51,6 +137,9 @@ class chfs_client {
   int readdir(inum, std::list<dirent> &);
   int write(inum, size_t, off_t, const char *, size_t &);
   int read(inum, size_t, off_t, std::string &);
+  int read(inum, size_t, off_t, file_view &, uint64_t);
+  uint64_t open(inum);
+  void release(uint64_t);
   int unlink(inum,const char *);
   int mkdir(inum , const char *, mode_t , inum &);
   int ln(inum, const char *, mode_t, inum &);
@@ -0,0 +1,379 @@
+#include "disk_io.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Submission ring size. The completion ring is twice as big, which
+// bounds the I/Os in flight.
+#define URING_ENTRIES 128
+
+// Workers of the thread pool backend.
+#define IO_THREADS 4
+
+void io_batch::read(uint32_t id, uint32_t n, char *buf)
+{
+  req r = {id, n, buf, false};
+  reqs.push_back(r);
+}
+
+void io_batch::write(uint32_t id, uint32_t n, const char *buf)
+{
+  req r = {id, n, (char *)buf, true};
+  reqs.push_back(r);
+}
+
+void io_batch::clear()
+{
+  reqs.clear();
+  ops.clear();
+  pending = 0;
+  failed = false;
+}
+
+// Turn the requests into ops, one per run of requests in the same
+// direction that follow each other on the disk.
+void io_batch::merge(uint32_t block_size)
+{
+  std::vector<req> sorted(reqs);
+  std::sort(sorted.begin(), sorted.end(), [](const req &a, const req &b) {
+    return a.write != b.write ? a.write < b.write : a.id < b.id;
+  });
+  ops.clear();
+  for (size_t i = 0; i < sorted.size(); ++i)
+  {
+    const req &r = sorted[i];
+    uint64_t off = (uint64_t)r.id * block_size;
+    struct iovec iov = {r.buf, (size_t)r.n * block_size};
+    if (ops.empty() || ops.back().write != r.write || ops.back().off + ops.back().len != off ||
+        ops.back().iov.size() >= IOV_MAX)
+    {
+      ops.push_back(io_op());
+      ops.back().write = r.write;
+      ops.back().off = off;
+      ops.back().len = 0;
+      ops.back().batch = this;
+      ops.back().res = 0;
+    }
+    ops.back().iov.push_back(iov);
+    ops.back().len += iov.iov_len;
+  }
+  pending = ops.size();
+}
+
+void io_batch::finish(io_op *op, ssize_t res)
+{
+  op->res = res;
+  std::lock_guard<std::mutex> lock(m);
+  if (--pending == 0)
+  {
+    cv.notify_all();
+  }
+}
+
+void io_batch::wait()
+{
+  std::unique_lock<std::mutex> lock(m);
+  while (pending > 0)
+  {
+    cv.wait(lock);
+  }
+}
+
+io_backend *io_backend::open(int fd, const char *kind)
+{
+  if (kind == NULL || strcmp(kind, "uring") == 0)
+  {
+    uring_backend *u = new uring_backend(fd);
+    if (u->ok())
+    {
+      return u;
+    }
+    delete u;
+    if (kind != NULL)
+    {
+      printf("\tdisk: no io_uring, using threads\n");
+    }
+  }
+  return new pool_backend(fd, IO_THREADS);
+}
+
+// io_uring ---------------------------------------------
+
+uring_backend::uring_backend(int fd)
+  : fd(fd), ring_fd(-1), entries(0), sq_ring(MAP_FAILED), sq_ring_size(0),
+    cq_ring(MAP_FAILED), cq_ring_size(0), sqes((struct io_uring_sqe *)MAP_FAILED),
+    sqes_size(0), inflight(0)
+{
+  if (setup())
+  {
+    reaper = std::thread(&uring_backend::reap_loop, this);
+  }
+}
+
+uring_backend::~uring_backend()
+{
+  if (reaper.joinable())
+  {
+    // a nop with no op tells the reaper to stop
+    {
+      std::lock_guard<std::mutex> lock(m);
+      push(NULL);
+      enter(1);
+    }
+    reaper.join();
+  }
+  if (sqes != MAP_FAILED)
+  {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+  {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != MAP_FAILED)
+  {
+    munmap(sq_ring, sq_ring_size);
+  }
+  if (ring_fd >= 0)
+  {
+    close(ring_fd);
+  }
+}
+
+// Create the ring and map its queues. Return false if the kernel has no
+// io_uring or refuses it.
+bool uring_backend::setup()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int rfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (rfd < 0)
+  {
+    return false;
+  }
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 rfd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+  {
+    close(rfd);
+    return false;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    cq_ring = sq_ring;
+  }
+  else
+  {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   rfd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+    {
+      close(rfd);
+      return false;
+    }
+  }
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+  {
+    close(rfd);
+    return false;
+  }
+
+  char *sq = (char *)sq_ring;
+  char *cq = (char *)cq_ring;
+  sq_head = (unsigned *)(sq + p.sq_off.head);
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  entries = p.sq_entries;
+  ring_fd = rfd;
+  return true;
+}
+
+// Queue op on the submission ring; NULL queues a nop. Called with m held.
+void uring_backend::push(io_op *op)
+{
+  unsigned tail = *sq_tail;
+  unsigned idx = tail & sq_mask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  if (op == NULL)
+  {
+    sqe->opcode = IORING_OP_NOP;
+  }
+  else
+  {
+    sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = op->off;
+    sqe->addr = (uint64_t)(uintptr_t)op->iov.data();
+    sqe->len = op->iov.size();
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+  }
+  sq_array[idx] = idx;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Hand the kernel the n entries queued. It takes them all before
+// returning, so the ring is empty again. Called with m held.
+void uring_backend::enter(unsigned n)
+{
+  while (n > 0)
+  {
+    int r = syscall(__NR_io_uring_enter, ring_fd, n, 0, 0, NULL, 0);
+    if (r < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+      {
+        continue;
+      }
+      perror("disk: io_uring_enter");
+      exit(1);
+    }
+    n -= r;
+  }
+}
+
+void uring_backend::submit(io_op *ops, size_t n)
+{
+  std::unique_lock<std::mutex> lock(m);
+  unsigned queued = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (queued == entries || inflight == 2 * entries)
+    {
+      enter(queued);
+      queued = 0;
+    }
+    // completions must not overflow their ring
+    while (inflight >= 2 * entries)
+    {
+      cv.wait(lock);
+    }
+    push(&ops[i]);
+    ++queued;
+    ++inflight;
+  }
+  enter(queued);
+}
+
+void uring_backend::reap_loop()
+{
+  for (;;)
+  {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+      int r = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (r < 0 && errno != EINTR)
+      {
+        perror("disk: io_uring_enter");
+        exit(1);
+      }
+      continue;
+    }
+    bool stop = false;
+    unsigned done = 0;
+    for (; head != tail; ++head)
+    {
+      struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+      io_op *op = (io_op *)(uintptr_t)cqe->user_data;
+      if (op == NULL)
+      {
+        stop = true;
+        continue;
+      }
+      op->batch->finish(op, cqe->res);
+      ++done;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    {
+      std::lock_guard<std::mutex> lock(m);
+      inflight -= done;
+    }
+    cv.notify_all();
+    if (stop)
+    {
+      return;
+    }
+  }
+}
+
+// thread pool ------------------------------------------
+
+pool_backend::pool_backend(int fd, int nthreads) : fd(fd), stopping(false)
+{
+  for (int i = 0; i < nthreads; ++i)
+  {
+    workers.push_back(std::thread(&pool_backend::work, this));
+  }
+}
+
+pool_backend::~pool_backend()
+{
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stopping = true;
+  }
+  cv.notify_all();
+  for (size_t i = 0; i < workers.size(); ++i)
+  {
+    workers[i].join();
+  }
+}
+
+void pool_backend::submit(io_op *ops, size_t n)
+{
+  {
+    std::lock_guard<std::mutex> lock(m);
+    for (size_t i = 0; i < n; ++i)
+    {
+      queue.push_back(&ops[i]);
+    }
+  }
+  cv.notify_all();
+}
+
+void pool_backend::work()
+{
+  std::unique_lock<std::mutex> lock(m);
+  for (;;)
+  {
+    while (queue.empty() && !stopping)
+    {
+      cv.wait(lock);
+    }
+    if (queue.empty())
+    {
+      return;
+    }
+    io_op *op = queue.front();
+    queue.pop_front();
+    lock.unlock();
+    ssize_t res = op->write ? pwritev(fd, op->iov.data(), op->iov.size(), op->off)
+                            : preadv(fd, op->iov.data(), op->iov.size(), op->off);
+    op->batch->finish(op, res < 0 ? -errno : res);
+    lock.lock();
+  }
+}
@@ -0,0 +1,144 @@
+// asynchronous disk I/O interface.
+
+#ifndef disk_io_h
+#define disk_io_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class io_batch;
+
+// One vectored transfer between the image file and memory.
+typedef struct io_op
+{
+  bool write;
+  uint64_t off;
+  size_t len;
+  std::vector<struct iovec> iov;
+  io_batch *batch;
+  ssize_t res; // bytes moved, or -errno
+} io_op_t;
+
+// A set of block transfers issued together. Requests are added with
+// read() and write(), then handed to disk::submit, which merges those
+// next to each other on the disk into single vectored I/Os and puts them
+// all in flight; disk::complete waits for the lot. Requests in a batch
+// must not overlap. A batch can be reused once it completes.
+class io_batch
+{
+private:
+  friend class disk;
+  friend class buffer_cache;
+
+  struct req
+  {
+    uint32_t id;
+    uint32_t n;
+    char *buf;
+    bool write;
+  };
+
+  std::vector<req> reqs;
+  std::vector<io_op> ops;
+  std::mutex m;
+  std::condition_variable cv;
+  size_t pending;
+  bool failed; // a write found no room on a log-structured disk
+
+  void merge(uint32_t block_size);
+  void wait();
+
+public:
+  io_batch() : pending(0), failed(false) {}
+  void read(uint32_t id, uint32_t n, char *buf);
+  void write(uint32_t id, uint32_t n, const char *buf);
+  bool empty() const { return reqs.empty(); }
+  void clear();
+  void finish(io_op *op, ssize_t res);
+};
+
+// Where the I/Os of a batch are carried out. finish() is called on the
+// op's batch once each op is done, from whatever thread completes it.
+class io_backend
+{
+public:
+  virtual ~io_backend() {}
+  virtual const char *name() const = 0;
+  virtual void submit(io_op *ops, size_t n) = 0;
+
+  // A backend for the image open at fd: io_uring if the kernel has it,
+  // else a pool of threads. kind ("uring" or "threads") forces one.
+  static io_backend *open(int fd, const char *kind);
+};
+
+// io_uring, driven through the raw system calls. Submitters share the
+// submission ring under a lock; a reaper thread takes completions off
+// the completion ring.
+class uring_backend : public io_backend
+{
+private:
+  int fd;
+  int ring_fd;
+  unsigned entries;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  std::mutex m;
+  std::condition_variable cv;
+  unsigned inflight; // kept within the completion ring
+  std::thread reaper;
+
+  bool setup();
+  void push(io_op *op);
+  void enter(unsigned n);
+  void reap_loop();
+
+public:
+  uring_backend(int fd);
+  ~uring_backend();
+  bool ok() const { return ring_fd >= 0; }
+  const char *name() const { return "io_uring"; }
+  void submit(io_op *ops, size_t n);
+};
+
+// preadv/pwritev on a pool of worker threads.
+class pool_backend : public io_backend
+{
+private:
+  int fd;
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<io_op *> queue;
+  bool stopping;
+  std::vector<std::thread> workers;
+
+  void work();
+
+public:
+  pool_backend(int fd, int nthreads);
+  ~pool_backend();
+  const char *name() const { return "threads"; }
+  void submit(io_op *ops, size_t n);
+};
+
+#endif
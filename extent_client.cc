@@ -12,6 +12,11 @@ extent_client::extent_client()
   es = new extent_server();
 }
 
+extent_client::~extent_client()
+{
+  delete es;
+}
+
 extent_protocol::status extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   extent_protocol::status ret = extent_protocol::OK;
@@ -26,6 +31,26 @@ extent_protocol::status extent_client::get(extent_protocol::extentid_t eid, std:
   return ret;
 }
 
+extent_protocol::status extent_client::read(extent_protocol::extentid_t eid, unsigned long long off,
+                                            unsigned int len, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->read(eid, off, len, buf);
+  return ret;
+}
+
+extent_protocol::status extent_client::read_view(extent_protocol::extentid_t eid, unsigned long long off,
+                                                 unsigned int len, file_view &v)
+{
+  return es->read_view(eid, off, len, v);
+}
+
+extent_protocol::status extent_client::prefetch(extent_protocol::extentid_t eid, unsigned long long off,
+                                                unsigned int len)
+{
+  return es->prefetch(eid, off, len);
+}
+
 extent_protocol::status extent_client::getattr(extent_protocol::extentid_t eid, 
 		       extent_protocol::attr &attr)
 {
@@ -42,6 +67,15 @@ extent_protocol::status extent_client::put(extent_protocol::extentid_t eid, std:
   return ret;
 }
 
+extent_protocol::status extent_client::write(extent_protocol::extentid_t eid, unsigned long long off,
+                                             std::string buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->write(eid, off, buf, r);
+  return ret;
+}
+
 extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret = extent_protocol::OK;
@@ -55,6 +89,27 @@ extent_protocol::status extent_client::read_dir(extent_protocol::extentid_t eid,
   return es->read_dir(eid, bufs);
 }
 
+extent_protocol::status extent_client::lookup(extent_protocol::extentid_t parent_id, std::string name,
+                                              extent_protocol::extentid_t &eid)
+{
+  return es->lookup(parent_id, name, eid);
+}
+
+extent_protocol::status extent_client::create_in(extent_protocol::extentid_t parent_id, std::string name,
+                                                 uint32_t type, extent_protocol::extentid_t &eid)
+{
+  return es->create_in(parent_id, name, type, eid);
+}
+
+extent_protocol::status extent_client::unlink(extent_protocol::extentid_t parent_id, std::string name,
+                                              extent_protocol::extentid_t &eid)
+{
+  int r = 0;
+  extent_protocol::status ret = es->unlink(parent_id, name, r);
+  eid = (unsigned int)r;
+  return ret;
+}
+
 extent_protocol::status extent_client::add_to_dir(extent_protocol::extentid_t parent_id, extent_protocol::extentid_t eid, std::string name)
 {
   return es->add_to_dir(parent_id, eid, name);
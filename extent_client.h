@@ -14,15 +14,30 @@ class extent_client {
 
  public:
   extent_client();
+  ~extent_client();
 
   extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
+  extent_protocol::status read(extent_protocol::extentid_t eid, unsigned long long off,
+                              unsigned int len, std::string &buf);
+  extent_protocol::status read_view(extent_protocol::extentid_t eid, unsigned long long off,
+                                   unsigned int len, file_view &v);
+  extent_protocol::status prefetch(extent_protocol::extentid_t eid, unsigned long long off,
+                                  unsigned int len);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  extent_protocol::status write(extent_protocol::extentid_t eid, unsigned long long off,
+                               std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
   extent_protocol::status read_dir(extent_protocol::extentid_t eid, std::vector<std::pair<extent_protocol::extentid_t, std::string>> &bufs);
+  extent_protocol::status lookup(extent_protocol::extentid_t parent_id, std::string name,
+                                extent_protocol::extentid_t &eid);
+  extent_protocol::status create_in(extent_protocol::extentid_t parent_id, std::string name,
+                                   uint32_t type, extent_protocol::extentid_t &eid);
+  extent_protocol::status unlink(extent_protocol::extentid_t parent_id, std::string name,
+                                extent_protocol::extentid_t &eid);
   extent_protocol::status add_to_dir(extent_protocol::extentid_t parent_id, extent_protocol::extentid_t eid, std::string name);
   extent_protocol::status remove_from_dir(extent_protocol::extentid_t eid, extent_protocol::extentid_t id);
   extent_protocol::status set_attr(extent_protocol::extentid_t eid, size_t size);
@@ -9,12 +9,17 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, FBIG, NOSPC, NOTEMPTY };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    read,
+    write,
+    lookup,
+    create_in,
+    unlink
   };
 
   enum types {
@@ -28,7 +33,7 @@ class extent_protocol {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
-    unsigned int size;
+    unsigned long long size;
   };
 };
 
@@ -1,6 +1,8 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include <algorithm>
+#include <errno.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,22 +16,149 @@ extent_server::extent_server()
   im = new inode_manager();
 }
 
+extent_server::~extent_server()
+{
+  delete im;
+}
+
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   // alloc a new inode and return inum
   printf("extent_server: create inode\n");
+  txn t(im);
+  if (t.failed())
+  {
+    return extent_protocol::NOSPC;
+  }
   id = im->alloc_inode(type);
 
   return extent_protocol::OK;
 }
 
+// Size of file id, 0 if there is none.
+uint64_t extent_server::file_size(extent_protocol::extentid_t id)
+{
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->get_attr(id, a);
+  return a.size;
+}
+
+// The journal bounds what one operation may change, so the helpers below
+// break up operations on more than im->op_bytes() of file data. Each
+// step is atomic, the whole is not: a crash can leave a file partly
+// resized or written. Each returns -ENOSPC if the journal refuses a step.
+
+// Grow or shrink file id from size from to size to.
+int extent_server::resize(extent_protocol::extentid_t id, uint64_t from, uint64_t to)
+{
+  uint64_t step = im->op_bytes();
+  while (from != to)
+  {
+    uint64_t next = from < to ? from + std::min(step, to - from) : from - std::min(step, from - to);
+    txn t(im, from < to ? next - from : from - next);
+    if (t.failed())
+    {
+      return -ENOSPC;
+    }
+    im->set_attr(id, next);
+    from = next;
+  }
+  return 0;
+}
+
+// Write len bytes of data at off, as inode_manager::write_file does. A
+// gap between the end of the file and off is filled with zeros first.
+int extent_server::write_steps(extent_protocol::extentid_t id, uint64_t off, const char *data, uint32_t len)
+{
+  uint64_t step = im->op_bytes();
+  uint64_t from = std::min(off, file_size(id));
+  uint64_t end = off + len;
+  if (end >= from && end - from <= step)
+  {
+    txn t(im, end - from);
+    if (t.failed())
+    {
+      return -ENOSPC;
+    }
+    return im->write_file(id, off, data, len);
+  }
+
+  uint64_t max = im->max_file_size(id);
+  if (max == 0)
+  {
+    return 0;
+  }
+  if (len > max || off > max - len)
+  {
+    return -EFBIG;
+  }
+  std::vector<char> zeros(std::min(step, off - from), 0);
+  for (uint64_t pos = from; pos < end;)
+  {
+    uint64_t next = std::min(pos + step, pos < off ? off : end);
+    txn t(im, next - pos);
+    if (t.failed())
+    {
+      return -ENOSPC;
+    }
+    int r = pos < off ? im->write_file(id, pos, zeros.data(), next - pos)
+                      : im->write_file(id, pos, data + (pos - off), next - pos);
+    if (r < 0)
+    {
+      return r;
+    }
+    pos = next;
+  }
+  return len;
+}
+
+// Free file id and its blocks.
+int extent_server::free_file(extent_protocol::extentid_t id)
+{
+  uint64_t size = file_size(id);
+  if (size > im->op_bytes())
+  {
+    if (resize(id, size, 0) < 0)
+    {
+      return -ENOSPC;
+    }
+    size = 0;
+  }
+  txn t(im, size);
+  if (t.failed())
+  {
+    return -ENOSPC;
+  }
+  im->remove_file(id);
+  return 0;
+}
+
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
 {
   id &= 0x7fffffff;
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
-  im->write_file(id, cbuf, size);
+  uint64_t old = file_size(id);
+  if (old + size <= im->op_bytes())
+  {
+    txn t(im, old + size);
+    if (t.failed())
+    {
+      return extent_protocol::NOSPC;
+    }
+    if (im->write_file(id, cbuf, size) < 0)
+    {
+      return extent_protocol::NOSPC;
+    }
+    return extent_protocol::OK;
+  }
+  // too big to replace in one step: empty the file, then fill it
+  if (resize(id, old, 0) < 0 || write_steps(id, 0, cbuf, size) < 0)
+  {
+    return extent_protocol::NOSPC;
+  }
   
   return extent_protocol::OK;
 }
@@ -54,6 +183,66 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   return extent_protocol::OK;
 }
 
+// Read len bytes from off on; shorter at the end of the file.
+int extent_server::read(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, std::string &buf)
+{
+  printf("extent_server: read %lld off %llu len %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+
+  // len may ask for far more than the file holds
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->get_attr(id, a);
+  len = off >= a.size ? 0 : std::min<uint64_t>(len, a.size - off);
+  buf.resize(len);
+  int size = len == 0 ? 0 : im->read_file(id, off, len, &buf[0]);
+  buf.resize(size);
+
+  return extent_protocol::OK;
+}
+
+// Like read, but hand back views of the data instead of a copy. Only
+// useful in the same address space, so there is no RPC for it.
+int extent_server::read_view(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, file_view &v)
+{
+  id &= 0x7fffffff;
+  im->read_view(id, off, len, v);
+
+  return extent_protocol::OK;
+}
+
+// Warm the cache with a range about to be read. Local only, like
+// read_view.
+int extent_server::prefetch(extent_protocol::extentid_t id, unsigned long long off, unsigned int len)
+{
+  id &= 0x7fffffff;
+  im->prefetch(id, off, len);
+
+  return extent_protocol::OK;
+}
+
+// Write buf at off, growing the file if it ends past the end.
+int extent_server::write(extent_protocol::extentid_t id, unsigned long long off, std::string buf, int &)
+{
+  id &= 0x7fffffff;
+  int r = write_steps(id, off, buf.data(), buf.size());
+  if (r == -EFBIG)
+  {
+    return extent_protocol::FBIG;
+  }
+  if (r == -EISDIR)
+  {
+    return extent_protocol::IOERR;
+  }
+  if (r < 0)
+  {
+    return extent_protocol::NOSPC;
+  }
+
+  return extent_protocol::OK;
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
   printf("extent_server: getattr %lld\n", id);
@@ -73,7 +262,10 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   printf("extent_server: remove %lld\n", id);
 
   id &= 0x7fffffff;
-  im->remove_file(id);
+  if (free_file(id) < 0)
+  {
+    return extent_protocol::NOSPC;
+  }
  
   return extent_protocol::OK;
 }
@@ -86,9 +278,78 @@ int extent_server::read_dir(extent_protocol::extentid_t id, std::vector<std::pai
   return extent_protocol::OK;
 }
 
+// Resolve name in directory parent_id; id is 0 if there is no such entry.
+int extent_server::lookup(extent_protocol::extentid_t parent_id, std::string name, extent_protocol::extentid_t &id)
+{
+  printf("extent_server: lookup %s in %lld\n", name.c_str(), parent_id);
+  id = im->lookup(parent_id, name);
+  return extent_protocol::OK;
+}
+
+// Create an inode of type and enter it in parent_id as name, in one step.
+// If the name is taken, return EXIST with id set to the inode it names.
+int extent_server::create_in(extent_protocol::extentid_t parent_id, std::string name, uint32_t type,
+                             extent_protocol::extentid_t &id)
+{
+  printf("extent_server: create %s in %lld\n", name.c_str(), parent_id);
+  uint32_t inum = 0;
+  txn t(im);
+  if (t.failed())
+  {
+    return extent_protocol::NOSPC;
+  }
+  bool created = im->create_in(parent_id, name, type, inum);
+  id = inum;
+  if (!created)
+  {
+    return id != 0 ? extent_protocol::EXIST : extent_protocol::IOERR;
+  }
+  return extent_protocol::OK;
+}
+
+// Remove name from parent_id and free the inode it named, returned in r.
+// A directory must be empty. A file too big to free in one transaction
+// is shrunk a step at a time first, whatever the name names at each step.
+int extent_server::unlink(extent_protocol::extentid_t parent_id, std::string name, int &r)
+{
+  printf("extent_server: unlink %s from %lld\n", name.c_str(), parent_id);
+  uint64_t step = std::min<uint64_t>(UNLINK_BYTES, im->op_bytes());
+  for (;;)
+  {
+    txn t(im, step);
+    if (t.failed())
+    {
+      return extent_protocol::NOSPC;
+    }
+    uint32_t id = 0;
+    int e = im->unlink(parent_id, name, id, step);
+    if (e == -EAGAIN)
+    {
+      step = im->op_bytes();
+      continue;
+    }
+    if (e == -ENOTEMPTY)
+    {
+      return extent_protocol::NOTEMPTY;
+    }
+    if (e < 0)
+    {
+      return extent_protocol::NOENT;
+    }
+    im->remove_file(id);
+    r = id;
+    return extent_protocol::OK;
+  }
+}
+
 int extent_server::add_to_dir(extent_protocol::extentid_t parent_id, extent_protocol::extentid_t id, std::string name)
 {
   printf("extent_server: add %lld to %lld\n", id, parent_id);
+  txn t(im);
+  if (t.failed())
+  {
+    return extent_protocol::NOSPC;
+  }
   im->add_to_dir(parent_id, id, name);
   return extent_protocol::OK;
 }
@@ -96,6 +357,11 @@ int extent_server::add_to_dir(extent_protocol::extentid_t parent_id, extent_prot
 int extent_server::remove_from_dir(extent_protocol::extentid_t parent_id, extent_protocol::extentid_t id)
 {
   printf("extent_server: remove %lld from %lld\n", id, parent_id);
+  txn t(im);
+  if (t.failed())
+  {
+    return extent_protocol::NOSPC;
+  }
   im->remove_from_dir(parent_id, id);
   return extent_protocol::OK;
 }
@@ -103,6 +369,9 @@ int extent_server::remove_from_dir(extent_protocol::extentid_t parent_id, extent
 int extent_server::set_attr(extent_protocol::extentid_t id, size_t size)
 {
   printf("extent_server: set %lld attr size to %ld\n", id, size);
-  im->set_attr(id, size);
+  if (resize(id, file_size(id), size) < 0)
+  {
+    return extent_protocol::NOSPC;
+  }
   return extent_protocol::OK;
 }
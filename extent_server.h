@@ -9,6 +9,10 @@
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
+// Files up to this size are freed in the transaction that unlinks them.
+// Bigger ones are emptied in steps first.
+#define UNLINK_BYTES (64 * 1024)
+
 class extent_server {
  protected:
 #if 0
@@ -20,15 +24,29 @@ class extent_server {
 #endif
   inode_manager *im;
 
+  uint64_t file_size(extent_protocol::extentid_t id);
+  int resize(extent_protocol::extentid_t id, uint64_t from, uint64_t to);
+  int write_steps(extent_protocol::extentid_t id, uint64_t off, const char *data, uint32_t len);
+  int free_file(extent_protocol::extentid_t id);
+
  public:
   extent_server();
+  ~extent_server();
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
   int put(extent_protocol::extentid_t id, std::string, int &);
   int get(extent_protocol::extentid_t id, std::string &);
+  int read(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, std::string &);
+  int read_view(extent_protocol::extentid_t id, unsigned long long off, unsigned int len, file_view &v);
+  int prefetch(extent_protocol::extentid_t id, unsigned long long off, unsigned int len);
+  int write(extent_protocol::extentid_t id, unsigned long long off, std::string, int &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
   int read_dir(extent_protocol::extentid_t id, std::vector<std::pair<extent_protocol::extentid_t, std::string>> &bufs);
+  int lookup(extent_protocol::extentid_t parent_id, std::string name, extent_protocol::extentid_t &id);
+  int create_in(extent_protocol::extentid_t parent_id, std::string name, uint32_t type,
+                extent_protocol::extentid_t &id);
+  int unlink(extent_protocol::extentid_t parent_id, std::string name, int &);
   int add_to_dir(extent_protocol::extentid_t parent_id, extent_protocol::extentid_t id, std::string name);
   int remove_from_dir(extent_protocol::extentid_t parent_id, extent_protocol::extentid_t id);
   int set_attr(extent_protocol::extentid_t id, size_t size);
@@ -30,6 +30,11 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::lookup, &ls, &extent_server::lookup);
+  server.reg(extent_protocol::create_in, &ls, &extent_server::create_in);
+  server.reg(extent_protocol::unlink, &ls, &extent_server::unlink);
 
   while(1)
     sleep(1000);
@@ -21,6 +21,15 @@
 int myid;
 chfs_client *chfs;
 
+// Mount options. With the timeouts at 0, the default, the kernel asks
+// again for every path walk and stat; longer ones let it cache entries
+// and attributes, and keep_cache keeps file pages across opens. This
+// client must then be the only writer. The kernel drops the attributes of
+// a directory itself when it creates or removes an entry in it.
+double entry_timeout = 0.0;
+double attr_timeout = 0.0;
+bool keep_cache = false;
+
 int id() { 
     return myid;
 }
@@ -45,35 +54,24 @@ getattr(chfs_client::inum inum, struct stat &st)
     bzero(&st, sizeof(st));
 
     st.st_ino = inum;
-    printf("getattr %016llx %d\n", inum, chfs->isfile(inum));
-    if(chfs->isfile(inum)){
-        chfs_client::fileinfo info;
-        ret = chfs->getfile(inum, info);
-        if(ret != chfs_client::OK)
-            return ret;
+    chfs_client::statinfo info;
+    ret = chfs->stat(inum, info);
+    if(ret != chfs_client::OK)
+        return ret;
+    printf("getattr %016llx type %u\n", inum, info.type);
+    st.st_atime = info.atime;
+    st.st_mtime = info.mtime;
+    st.st_ctime = info.ctime;
+    if(info.type == extent_protocol::T_FILE){
         st.st_mode = S_IFREG | 0666;
         st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
         st.st_size = info.size;
         printf("   getattr size -> %llu\n", info.size);
-    } else if (chfs->isdir(inum)) {
-        chfs_client::dirinfo info;
-        ret = chfs->getdir(inum, info);
-        if(ret != chfs_client::OK)
-            return ret;
+    } else if (info.type == extent_protocol::T_DIR) {
         st.st_mode = S_IFDIR | 0777;
         st.st_nlink = 2;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
         printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
     } else {
-        chfs_client::fileinfo info;
-        ret = chfs->getfile(inum, info);
-        if(ret != chfs_client::OK)
-            return ret;
         st.st_mode = S_IFLNK | 0777;
         st.st_nlink = 1;
         st.st_size = info.size;
@@ -81,6 +79,16 @@ getattr(chfs_client::inum inum, struct stat &st)
     return chfs_client::OK;
 }
 
+// Timeouts and generation for an entry reply.
+void
+init_entry(struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
+    e->generation = 0;
+}
+
 //
 // This is a typical fuse operation handler; you'll be writing
 // a bunch of handlers like it.
@@ -109,7 +117,7 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, attr_timeout);
 }
 
 //
@@ -137,9 +145,12 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
     struct stat st;
     // Change the above line to "#if 1", and your code goes here
     // Note: fill st using getattr before fuse_reply_attr
-    chfs->setattr(ino, attr->st_size);
+    if (chfs->setattr(ino, attr->st_size) == chfs_client::NOSPC) {
+        fuse_reply_err(req, ENOSPC);
+        return;
+    }
     getattr(ino, st);
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, attr_timeout);
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -152,14 +163,14 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 //
 // Read up to @size bytes starting at byte offset @off in file @ino.
 //
-// Pass the number of bytes actually read to fuse_reply_buf.
+// Pass the bytes actually read to fuse_reply_iov.
 // If there are fewer than @size bytes to read between @off and the
 // end of the file, read just that many bytes. If @off is greater
 // than or equal to the size of the file, read zero bytes.
 //
-// Ignore @fi. 
+// @fi->fh is the handle chfs_client::open gave, for readahead.
 // @req identifies this request, and is used only to send a 
-// response back to fuse with fuse_reply_buf or fuse_reply_err.
+// response back to fuse with fuse_reply_iov or fuse_reply_err.
 //
 void
 fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
@@ -167,11 +178,17 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 {
 #if 1
     // Change the above "#if 0" to "#if 1", and your code goes here
-    std::string read_str;
-    chfs->read(ino, size, off, read_str);
-    std::cout << "fuse read : read " << read_str << std::endl;
-    fuse_reply_buf(req, read_str.c_str(), read_str.size());
-    
+    // the reply is gathered straight from the cache and the disk image;
+    // v keeps the file read locked until the reply is sent
+    file_view v;
+    if (chfs->read(ino, size, off, v, fi->fh) != chfs_client::OK)
+    {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    std::cout << "fuse read : read " << v.bytes << " bytes" << std::endl;
+    fuse_reply_iov(req, v.iov.data(), v.iov.size());
+
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -202,8 +219,16 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 #if 1
     // Change the above line to "#if 1", and your code goes here
     size_t write_bytes = 0;
-    chfs->write(ino, size, off, buf, write_bytes);
-    fuse_reply_write(req, write_bytes);
+    chfs_client::status ret = chfs->write(ino, size, off, buf, write_bytes);
+    if (ret == chfs_client::FBIG) {
+        fuse_reply_err(req, EFBIG);
+    } else if (ret == chfs_client::NOSPC) {
+        fuse_reply_err(req, ENOSPC);
+    } else if (ret != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+    } else {
+        fuse_reply_write(req, write_bytes);
+    }
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -232,10 +257,7 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
-    e->generation = 0;
+    init_entry(e);
 
     chfs_client::inum inum;
     if ( type == extent_protocol::T_FILE )
@@ -258,11 +280,14 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     struct fuse_entry_param e;
     chfs_client::status ret;
     if( (ret = fuseserver_createhelper( parent, name, mode, &e, extent_protocol::T_FILE)) == chfs_client::OK ) {
+        fi->fh = chfs->open(e.ino);
         fuse_reply_create(req, &e, fi);
         printf("OK: create returns.\n");
     } else {
         if (ret == chfs_client::EXIST) {
             fuse_reply_err(req, EEXIST);
+        } else if (ret == chfs_client::NOSPC) {
+            fuse_reply_err(req, ENOSPC);
         }else{
             fuse_reply_err(req, ENOENT);
         }
@@ -278,6 +303,8 @@ void fuseserver_mknod( fuse_req_t req, fuse_ino_t parent,
     } else {
         if (ret == chfs_client::EXIST) {
             fuse_reply_err(req, EEXIST);
+        } else if (ret == chfs_client::NOSPC) {
+            fuse_reply_err(req, ENOSPC);
         }else{
             fuse_reply_err(req, ENOENT);
         }
@@ -293,10 +320,7 @@ void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
+    init_entry(&e);
     bool found = false;
 
      chfs_client::inum ino;
@@ -306,6 +330,10 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
         e.ino = ino;
         getattr(ino, e.attr);
         fuse_reply_entry(req, &e);
+    } else if (entry_timeout > 0) {
+        // ino 0 lets the kernel cache the miss
+        e.ino = 0;
+        fuse_reply_entry(req, &e);
     } else {
         fuse_reply_err(req, ENOENT);
     }
@@ -380,9 +408,19 @@ void
 fuseserver_open(fuse_req_t req, fuse_ino_t ino,
         struct fuse_file_info *fi)
 {
+    fi->keep_cache = keep_cache;
+    fi->fh = chfs->open(ino);
     fuse_reply_open(req, fi);
 }
 
+void
+fuseserver_release(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    chfs->release(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
 //
 // Create a new directory with name @name in parent directory @parent.
 // Leave new directory's inum in e.ino and attributes in e.attr.
@@ -398,10 +436,6 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
         mode_t mode)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
 
 #if 1
     // Change the above line to "#if 1", and your code goes here
@@ -415,6 +449,10 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
     {
         fuse_reply_err(req, EEXIST);
     }
+    else
+    {
+        fuse_reply_err(req, ret == chfs_client::NOSPC ? ENOSPC : EIO);
+    }
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -437,8 +475,12 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     } else {
         if (r == chfs_client::NOENT) {
             fuse_reply_err(req, ENOENT);
-        } else {
+        } else if (r == chfs_client::NOTEMPTY) {
             fuse_reply_err(req, ENOTEMPTY);
+        } else if (r == chfs_client::NOSPC) {
+            fuse_reply_err(req, ENOSPC);
+        } else {
+            fuse_reply_err(req, EIO);
         }
     }
 }
@@ -464,10 +506,6 @@ fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const ch
 #if 1
     // Change the above line to "#if 1", and your code goes here
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
     std::cout << "fuse symlink : link " << name << " to " << link << std::endl;
 
     chfs_client::status ret = fuseserver_createhelper(parent, name, O_RDWR, &e, extent_protocol::T_LNK);
@@ -475,6 +513,8 @@ fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const ch
     {
         size_t write_bytes = 0;
         chfs->write(e.ino, strlen(link), 0, link, write_bytes);
+        // the attributes were taken before the target was written
+        getattr(e.ino, e.attr);
         fuse_reply_entry(req, &e);
     }
     else
@@ -492,7 +532,12 @@ fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
 #if 1
     // Change the above "#if 0" to "#if 1", and your code goes here
     std::string read_str;
-    chfs->read(ino, UINT32_MAX, 0, read_str);
+    chfs_client::statinfo st;
+    if (chfs->stat(ino, st) != chfs_client::OK ||
+        chfs->read(ino, st.size, 0, read_str) != chfs_client::OK) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
     std::cout << "fuse readlink : read " << read_str << std::endl;
     fuse_reply_buf(req, read_str.c_str(), read_str.size());
     
@@ -503,6 +548,28 @@ fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+// Take the mount options chfs handles out of a comma separated list.
+// Return the rest, which are passed on to fuse.
+std::string
+parse_options(char *opts)
+{
+    std::string rest;
+    for (char *o = strtok(opts, ","); o != NULL; o = strtok(NULL, ",")) {
+        if (strncmp(o, "entry_timeout=", 14) == 0) {
+            entry_timeout = atof(o + 14);
+        } else if (strncmp(o, "attr_timeout=", 13) == 0) {
+            attr_timeout = atof(o + 13);
+        } else if (strcmp(o, "keep_cache") == 0) {
+            keep_cache = true;
+        } else {
+            if (!rest.empty())
+                rest += ",";
+            rest += o;
+        }
+    }
+    return rest;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -518,11 +585,15 @@ main(int argc, char *argv[])
         exit(1);
     }
 #endif
-    if(argc != 2){
-        fprintf(stderr, "Usage: chfs_client <mountpoint>\n");
+    if(argc != 2 && !(argc == 4 && strcmp(argv[2], "-o") == 0)){
+        fprintf(stderr, "Usage: chfs_client <mountpoint> "
+                "[-o entry_timeout=S,attr_timeout=S,keep_cache]\n");
         exit(1);
     }
     mountpoint = argv[1];
+    std::string fuse_opts;
+    if (argc == 4)
+        fuse_opts = parse_options(argv[3]);
 
     srandom(getpid());
 
@@ -539,6 +610,7 @@ main(int argc, char *argv[])
     fuseserver_oper.mknod      = fuseserver_mknod;
     fuseserver_oper.open       = fuseserver_open;
     fuseserver_oper.read       = fuseserver_read;
+    fuseserver_oper.release    = fuseserver_release;
     fuseserver_oper.write      = fuseserver_write;
     fuseserver_oper.setattr    = fuseserver_setattr;
     fuseserver_oper.unlink     = fuseserver_unlink;
@@ -566,12 +638,18 @@ main(int argc, char *argv[])
     //fuse_argv[fuse_argc++] = "-o";
     //fuse_argv[fuse_argc++] = "allow_other";
 
+    if (!fuse_opts.empty()) {
+        fuse_argv[fuse_argc++] = "-o";
+        fuse_argv[fuse_argc++] = fuse_opts.c_str();
+    }
+
     fuse_argv[fuse_argc++] = mountpoint;
     fuse_argv[fuse_argc++] = "-d";
 
     fuse_args args = FUSE_ARGS_INIT( fuse_argc, (char **) fuse_argv );
     int foreground;
-    int res = fuse_parse_cmdline( &args, &mountpoint, 0 /*multithreaded*/, 
+    int multithreaded;
+    int res = fuse_parse_cmdline( &args, &mountpoint, &multithreaded, 
             &foreground );
     if( res == -1 ) {
         fprintf(stderr, "fuse_parse_cmdline failed\n");
@@ -602,12 +680,16 @@ main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+    // requests are served by a pool of threads; chfs_client and the
+    // layers under it do their own locking
+    err = fuse_session_loop_mt(se);
 
     fuse_session_destroy(se);
     close(fd);
     fuse_unmount(mountpoint);
 
+    // write back whatever is still cached
+    delete chfs;
+
     return err ? 1 : 0;
 }
\ No newline at end of file
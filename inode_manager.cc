@@ -1,882 +1,3252 @@
 #include "inode_manager.h"
 
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // disk layer -----------------------------------------
 
-disk::disk()
+template <uint32_t BS>
+static void read_block_sized(const unsigned char *blocks, uint32_t id, char *buf)
 {
-  bzero(blocks, sizeof(blocks));
+  memcpy(buf, blocks + (size_t)id * BS, BS);
 }
 
-void disk::read_block(blockid_t id, char *buf) const
+template <uint32_t BS>
+static void write_block_sized(unsigned char *blocks, uint32_t id, const char *buf)
 {
-  memcpy(buf, blocks[id], BLOCK_SIZE);
+  memcpy(blocks + (size_t)id * BS, buf, BS);
 }
 
-void disk::write_block(blockid_t id, const char *buf)
+disk::disk(const char *image, uint64_t size)
 {
-  memcpy(blocks[id], buf, BLOCK_SIZE);
+  fd = -1;
+  fresh = true;
+  segs = NULL;
+  io = NULL;
+  unsynced = false;
+  bytes = size;
+  if (image == NULL)
+  {
+    // Anonymous pages are zero-filled on first touch, no need to bzero.
+    blocks = (unsigned char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  else
+  {
+    fd = open(image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+      perror("disk: open image");
+      exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+      perror("disk: stat image");
+      exit(1);
+    }
+    fresh = (st.st_size == 0);
+    // A short image is extended sparsely; holes read back as zeros.
+    if ((uint64_t)st.st_size < bytes)
+    {
+      if (ftruncate(fd, bytes) < 0)
+      {
+        perror("disk: extend image");
+        exit(1);
+      }
+    }
+    else
+    {
+      bytes = st.st_size;
+    }
+    blocks = (unsigned char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0);
+  }
+  if (blocks == MAP_FAILED)
+  {
+    perror("disk: mmap");
+    exit(1);
+  }
+  set_block_size(MIN_BLOCK_SIZE);
 }
 
-// block layer -----------------------------------------
-bool block_manager::is_free(blockid_t id) const
+disk::~disk()
 {
-  char buf[BLOCK_SIZE];
-  read_block(id / BPB + 2, buf);
-  return (buf[(id % BPB) / 8] & (0x1 << ((id % BPB) % 8))) == 0;
+  sync();
+  delete io;
+  munmap(blocks, bytes);
+  if (fd >= 0)
+  {
+    close(fd);
+  }
 }
 
-void block_manager::mark_bit(blockid_t id)
+// Copy n consecutive blocks starting at id in one go.
+void disk::read_range(uint32_t id, uint32_t n, char *buf) const
 {
-  char buf[BLOCK_SIZE];
-  read_block(id / BPB + 2, buf);
-  buf[(id % BPB) / 8] |= (0x1 << ((id % BPB) % 8));
-  write_block(id / BPB + 2, buf);
+  if (segs != NULL)
+  {
+    segs->read(id, n, buf);
+    return;
+  }
+  memcpy(buf, blocks + (size_t)id * block_size, (size_t)n * block_size);
 }
 
-void block_manager::unmark_bit(blockid_t id)
+bool disk::write_range(uint32_t id, uint32_t n, const char *buf)
 {
-  char buf[BLOCK_SIZE];
-  read_block(id / BPB + 2, buf);
-  buf[(id % BPB) / 8] &= ~(0x1 << ((id % BPB) % 8));
-  write_block(id / BPB + 2, buf);
+  unsynced = true;
+  if (segs != NULL)
+  {
+    return segs->write(id, n, buf);
+  }
+  memcpy(blocks + (size_t)id * block_size, buf, (size_t)n * block_size);
+  return true;
 }
 
-// Allocate a free disk block.
-blockid_t
-block_manager::alloc_block()
+// Add to b the transfers of n blocks, ids[i] to or from the i-th block of
+// the memory iov describes; each iovec holds whole blocks. Blocks that
+// follow each other both on the disk and in memory go as one request.
+// Id 0 is a hole: it reads as zeros and is not written.
+static void batch_blocks(io_batch &b, bool write, const blockid_t *ids, uint32_t n,
+                         const struct iovec *iov, int iovcnt, uint32_t block_size)
 {
-  /*
-   * your code goes here.
-   * note: you should mark the corresponding bit in block bitmap when alloc.
-   * you need to think about which block you can start to be allocated.
-   */
-  for (blockid_t id = IBLOCK(sb.ninodes, sb.nblocks) + 1; id < sb.nblocks; ++id)
+  blockid_t run_id = 0;
+  uint32_t run_n = 0;
+  char *run_buf = NULL;
+  auto add_run = [&]() {
+    if (run_n == 0)
+    {
+      return;
+    }
+    if (write)
+    {
+      b.write(run_id, run_n, run_buf);
+    }
+    else
+    {
+      b.read(run_id, run_n, run_buf);
+    }
+    run_n = 0;
+  };
+
+  int v = 0;
+  size_t voff = 0;
+  for (uint32_t i = 0; i < n; ++i)
   {
-    if (is_free(id))
+    while (v < iovcnt && voff + block_size > iov[v].iov_len)
+    {
+      ++v;
+      voff = 0;
+    }
+    if (v == iovcnt)
+    {
+      break;
+    }
+    char *p = (char *)iov[v].iov_base + voff;
+    voff += block_size;
+    if (run_n > 0 && ids[i] == run_id + run_n && p == run_buf + (size_t)run_n * block_size)
     {
-      mark_bit(id);
-      return id;
+      ++run_n;
+      continue;
+    }
+    add_run();
+    if (ids[i] == 0)
+    {
+      if (!write)
+      {
+        memset(p, 0, block_size);
+      }
+      continue;
     }
+    run_id = ids[i];
+    run_n = 1;
+    run_buf = p;
   }
-  std::cout << "Cannot find free block" << std::endl;
-  return 0;
+  add_run();
 }
 
-void block_manager::free_block(uint32_t id)
+// Read or write n blocks, not necessarily in order on the disk, from or
+// to the memory iov describes (see batch_blocks).
+void disk::read_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt)
 {
-  /*
-   * your code goes here.
-   * note: you should unmark the corresponding bit in the block bitmap when free.
-   */
-  if (id > IBLOCK(sb.ninodes, sb.nblocks) && !is_free(id))
+  io_batch b;
+  batch_blocks(b, false, ids, n, iov, iovcnt, block_size);
+  submit(b);
+  complete(b);
+}
+
+bool disk::write_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt)
+{
+  io_batch b;
+  batch_blocks(b, true, ids, n, iov, iovcnt, block_size);
+  submit(b);
+  return complete(b);
+}
+
+// Carry out batched transfers of an image file asynchronously with the
+// backend kind names (see io_backend::open), or "mmap" to keep copying
+// through the mapping. The file and the mapping share the page cache, so
+// either way sees what the other wrote.
+void disk::start_io(const char *kind)
+{
+  if (fd >= 0 && io == NULL && (kind == NULL || strcmp(kind, "mmap") != 0))
   {
-    unmark_bit(id);
-    char buf[BLOCK_SIZE] = {0};
-    write_block(id, buf);
+    io = io_backend::open(fd, kind);
   }
-  return;
 }
 
-// The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager()
+// Put all the transfers of b in flight. A log-structured disk places
+// blocks itself, so there they are done right away.
+void disk::submit(io_batch &b)
 {
-  d = new disk();
-
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
+  b.merge(block_size);
+  // merge puts the writes last
+  if (!b.ops.empty() && b.ops.back().write)
+  {
+    unsynced = true;
+  }
+  if (io == NULL || segs != NULL)
+  {
+    for (size_t i = 0; i < b.reqs.size(); ++i)
+    {
+      const io_batch::req &r = b.reqs[i];
+      if (r.write)
+      {
+        b.failed |= !write_range(r.id, r.n, r.buf);
+      }
+      else
+      {
+        read_range(r.id, r.n, r.buf);
+      }
+    }
+    for (size_t i = 0; i < b.ops.size(); ++i)
+    {
+      b.finish(&b.ops[i], b.ops[i].len);
+    }
+    return;
+  }
+  io->submit(b.ops.data(), b.ops.size());
 }
 
-void block_manager::read_block(uint32_t id, char *buf) const
+// Wait for the transfers of b. One that failed or came up short is
+// redone through the mapping. Return false if a write found no room on
+// a log-structured disk.
+bool disk::complete(io_batch &b)
 {
-  d->read_block(id, buf);
+  b.wait();
+  for (size_t i = 0; i < b.ops.size(); ++i)
+  {
+    io_op &op = b.ops[i];
+    if (op.res == (ssize_t)op.len)
+    {
+      continue;
+    }
+    unsigned char *p = blocks + op.off;
+    for (size_t j = 0; j < op.iov.size(); ++j)
+    {
+      if (op.write)
+      {
+        memcpy(p, op.iov[j].iov_base, op.iov[j].iov_len);
+      }
+      else
+      {
+        memcpy(op.iov[j].iov_base, p, op.iov[j].iov_len);
+      }
+      p += op.iov[j].iov_len;
+    }
+  }
+  return !b.failed;
 }
 
-void block_manager::write_block(uint32_t id, const char *buf)
+// Block id is no longer in use. Only a log-structured disk cares.
+void disk::discard(uint32_t id)
 {
-  d->write_block(id, buf);
+  if (segs != NULL)
+  {
+    segs->discard(id);
+  }
 }
 
-// inode layer -----------------------------------------
+// The image's copy of block id, to read in place. NULL if the block is
+// mapped by the segment log, since the cleaner may move it any time.
+const char *disk::block_data(uint32_t id) const
+{
+  if (segs != NULL && segs->mapped(id))
+  {
+    return NULL;
+  }
+  return (const char *)blocks + (size_t)id * block_size;
+}
 
-inode_manager::inode_manager()
+bool disk::set_block_size(uint32_t block_size)
 {
-  bm = new block_manager();
-  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
-  if (root_dir != 1)
+  this->block_size = block_size;
+  switch (block_size)
   {
-    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
-    exit(0);
+  case 512:
+    read_fn = read_block_sized<512>;
+    write_fn = write_block_sized<512>;
+    return true;
+  case 1024:
+    read_fn = read_block_sized<1024>;
+    write_fn = write_block_sized<1024>;
+    return true;
+  case 2048:
+    read_fn = read_block_sized<2048>;
+    write_fn = write_block_sized<2048>;
+    return true;
+  case 4096:
+    read_fn = read_block_sized<4096>;
+    write_fn = write_block_sized<4096>;
+    return true;
+  default:
+    return false;
   }
 }
 
-/* Create a new file.
- * Return its inum. */
-uint32_t
-inode_manager::alloc_inode(uint32_t type)
+void disk::sync()
 {
-  /*
-   * your code goes here.
-   * note: the normal inode block should begin from the 2nd inode block.
-   * the 1st is used for root_dir, see inode_manager::inode_manager().
-   */
-  if (type != extent_protocol::T_DIR && type != extent_protocol::T_FILE && type != extent_protocol::T_LNK)
+  unsynced = false;
+  if (segs != NULL)
   {
-    return 0;
+    segs->syncing();
+  }
+  if (fd >= 0)
+  {
+    msync(blocks, bytes, MS_SYNC);
   }
+}
 
-  uint32_t id = find_free_inode();
-  if (id == 0)
+// Flush just the pages holding n blocks from id on.
+void disk::sync_range(uint32_t id, uint32_t n)
+{
+  if (fd >= 0)
   {
-    throw std::bad_alloc();
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = (size_t)id * block_size;
+    size_t to = from + (size_t)n * block_size;
+    from -= from % page;
+    msync(blocks + from, to - from, MS_SYNC);
   }
-  struct inode * ino = (struct inode *)malloc(sizeof(struct inode));
-  ino->size = 0;
-  uint32_t curr_time = (uint32_t)time(NULL);
-  ino->atime = curr_time;
-  ino->ctime = curr_time;
-  ino->mtime = curr_time;
-  memset(ino->blocks, 0, sizeof(ino->blocks));
-  ino->type = type;
-  put_inode(id, ino);
-  return id;
 }
 
-void inode_manager::free_inode(uint32_t inum)
+// Flush blocks ids, wherever they were written. Neighbouring blocks are
+// flushed together.
+void disk::sync_blocks(std::vector<uint32_t> ids)
 {
-  /*
-   * your code goes here.
-   * note: you need to check if the inode is already a freed one;
-   * if not, clear it, and remember to write back to disk.
-   */
-  struct inode *ino = get_inode(inum);
-  if (ino->type != 0)
+  if (segs != NULL)
   {
-    memset(ino, 0, sizeof(struct inode));
-    put_inode(inum, ino);
+    segs->flush();
+    return;
+  }
+  std::sort(ids.begin(), ids.end());
+  for (size_t i = 0, run; i < ids.size(); i += run)
+  {
+    for (run = 1; i + run < ids.size() && ids[i + run] <= ids[i + run - 1] + 1; ++run)
+    {
+    }
+    sync_range(ids[i], ids[i + run - 1] - ids[i] + 1);
   }
-  free(ino);
-  return;
 }
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
-struct inode *
-inode_manager::get_inode(uint32_t inum) const
+// Flush the blocks written by write_range or submit since the last sync:
+// on a log-structured disk, the segments written to, else the whole
+// image, as they are not tracked one by one.
+void disk::sync_written()
 {
-  struct inode *ino = (struct inode *)malloc(sizeof(struct inode));
-  /*
-   * your code goes here.
-   */
-  char buf[BLOCK_SIZE];
-  // printf("\tim: get_inode %d\n", inum);
-  if (inum > INODE_NUM || inum < 1)
+  if (segs != NULL)
   {
-    return NULL;
+    segs->flush();
+  }
+  else if (unsynced)
+  {
+    sync();
   }
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  *ino = *((struct inode *)buf + inum % IPB);
-  return ino;
 }
 
-void inode_manager::put_inode(uint32_t inum, struct inode *ino)
+// block layer -----------------------------------------
+
+// Return the index of the first word in [i, end) with a clear bit, or end
+// if they are all full. Full words are skipped a vector at a time.
+static size_t skip_full_words(const uint64_t *words, size_t i, size_t end)
 {
-  char buf[BLOCK_SIZE];
-  struct inode *ino_disk;
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  for (; i + 4 <= end; i += 4)
+  {
+    if (!_mm256_testc_si256(_mm256_loadu_si256((const __m256i *)(words + i)), ones))
+    {
+      break;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi32(-1);
+  for (; i + 2 <= end; i += 2)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff)
+    {
+      break;
+    }
+  }
+#endif
+  while (i < end && words[i] == ~(uint64_t)0)
+  {
+    ++i;
+  }
+  return i;
+}
 
-  printf("\tim: put_inode %d\n", inum);
-  if (ino == NULL || inum > INODE_NUM || inum < 1)
+// Find a clear bit at or after from in a bitmap of nwords words, wrapping
+// around to the start. Return 0 if there is none; bit 0 is taken in every
+// bitmap the file system keeps, so it never names a free object.
+static uint32_t find_clear_bit(const uint64_t *words, size_t nwords, uint32_t from)
+{
+  size_t i = from / 64;
+  // bits below from in its word count as taken
+  uint64_t w = words[i] | (((uint64_t)1 << (from % 64)) - 1);
+  if (~w != 0)
   {
-    return;
+    return i * 64 + __builtin_ctzll(~w);
+  }
+  i = skip_full_words(words, i + 1, nwords);
+  if (i == nwords)
+  {
+    i = skip_full_words(words, 0, nwords);
   }
+  if (i == nwords)
+  {
+    return 0;
+  }
+  return i * 64 + __builtin_ctzll(~words[i]);
+}
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode *)buf + inum % IPB;
-  *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+bool block_manager::is_free(blockid_t id) const
+{
+  return (bitmap[id / 64] & ((uint64_t)1 << (id % 64))) == 0;
 }
 
-uint32_t inode_manager::find_free_inode() const
+void block_manager::mark_bit(blockid_t id)
+{
+  bitmap[id / 64] |= (uint64_t)1 << (id % 64);
+  write_bitmap_block(id);
+}
+
+void block_manager::unmark_bit(blockid_t id)
 {
-  uint32_t id = 1;
-  while (id <= bm->sb.nblocks)
+  bitmap[id / 64] &= ~((uint64_t)1 << (id % 64));
+  write_bitmap_block(id);
+}
+
+// Write the bitmap block holding the bit for block id back to disk.
+void block_manager::write_bitmap_block(blockid_t id)
+{
+  uint32_t index = id / BPB(sb);
+  write_block(sb.bmap_start + index, (const char *)&bitmap[(size_t)index * sb.block_size / 8]);
+}
+
+// Find a free block at or after from, wrapping around to the start.
+// Return 0 if there is none.
+blockid_t block_manager::find_free(blockid_t from) const
+{
+  return find_clear_bit(bitmap.data(), ((size_t)sb.nblocks + 63) / 64, from);
+}
+
+// Rebuild the free extent index from the bitmap.
+void block_manager::build_extent_index()
+{
+  free_extents.clear();
+  free_sizes.clear();
+  blockid_t start = 0;
+  uint32_t len = 0;
+  for (blockid_t id = sb.data_start; id < sb.nblocks; ++id)
   {
-    struct inode *ino = get_inode(id);
-    if (ino->type == 0)
+    if (id % 64 == 0 && id + 64 <= sb.nblocks && (bitmap[id / 64] == 0 || ~bitmap[id / 64] == 0))
+    {
+      // whole word free or whole word taken
+      if (bitmap[id / 64] == 0)
+      {
+        start = (len == 0) ? id : start;
+        len += 64;
+      }
+      else if (len > 0)
+      {
+        index_insert(start, len);
+        len = 0;
+      }
+      id += 63;
+    }
+    else if (is_free(id))
+    {
+      start = (len == 0) ? id : start;
+      ++len;
+    }
+    else if (len > 0)
     {
-      free(ino);
-      return id;
+      index_insert(start, len);
+      len = 0;
     }
-    free(ino);
-    ++id;
   }
-  return 0;
+  if (len > 0)
+  {
+    index_insert(start, len);
+  }
 }
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
-std::string inode_manager::array_to_string(const char *buf, uint32_t size) const
+void block_manager::index_insert(blockid_t start, uint32_t len)
 {
-  std::string str = "";
-  str.resize(size);
-  for (uint32_t i = 0; i < size; ++i)
+  if (len >= MIN_EXTENT)
   {
-    str[i] = buf[i];
+    free_extents[start] = len;
+    free_sizes.insert(std::make_pair(len, start));
   }
-  return str;
 }
 
-/* Get all the data of a file by inum.
- * Return alloced data, should be freed by caller. */
-void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) const
+void block_manager::index_erase(std::map<blockid_t, uint32_t>::iterator it)
 {
-  /*
-   * your code goes here.
-   * note: read blocks related to inode number inum,
-   * and copy them to buf_out
-   */
-  std::cout << "inode_manager: start read " << std::endl;
-  struct inode *ino = get_inode(inum);
-  if (ino == NULL)
+  free_sizes.erase(std::make_pair(it->second, it->first));
+  free_extents.erase(it);
+}
+
+// Remove [start, start + len) from the index. The range must lie inside
+// a single free extent; what is left of it on either side stays free.
+void block_manager::index_take(blockid_t start, uint32_t len)
+{
+  std::map<blockid_t, uint32_t>::iterator it = free_extents.upper_bound(start);
+  if (it == free_extents.begin())
+  {
+    return;
+  }
+  --it;
+  blockid_t ext_start = it->first;
+  uint32_t ext_len = it->second;
+  if (start >= ext_start + ext_len)
   {
+    // part of a short run, which is not indexed
     return;
   }
+  index_erase(it);
+  index_insert(ext_start, start - ext_start);
+  index_insert(start + len, ext_start + ext_len - start - len);
+}
+
+// Block id has just been freed. Merge it with the free runs on either
+// side and index the result if it is long enough. A neighbouring run
+// that is not indexed is shorter than MIN_EXTENT, so the bitmap scans
+// below are bounded.
+void block_manager::index_give(blockid_t id)
+{
+  blockid_t start = id;
+  uint32_t len = 1;
 
-  std::vector<std::string> direct_bufs;
-  int direct_size = 0;
-  direct_bufs.reserve(MIN(ino->size, NDIRECT));
-  for (uint32_t i = 0; i < MIN(ino->size, NDIRECT); ++i)
+  std::map<blockid_t, uint32_t>::iterator next = free_extents.lower_bound(id);
+  if (next != free_extents.end() && next->first == id + 1)
   {
-    char buf[BLOCK_SIZE];
-    bm->read_block(ino->blocks[i], buf);
-    buf[BLOCK_SIZE] = '\0';
-    std::string str = array_to_string(buf, BLOCK_SIZE);
-    direct_bufs.push_back(str);
-    direct_size += str.size();
+    len += next->second;
+    std::map<blockid_t, uint32_t>::iterator victim = next++;
+    index_erase(victim);
   }
-  std::vector<std::string> indirect_bufs;
-  int indirect_size = 0;
-  if (ino->size > NDIRECT)
+  else
   {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    while (len <= MIN_EXTENT && id + len < sb.nblocks && is_free(id + len))
     {
-      if (inum_buf[i] == 0)
-      {
-        break;
-      }
-      char *buf = NULL;
-      int one_size = 0;
-      read_file(inum_buf[i], &buf, &one_size);
-      indirect_bufs.push_back(array_to_string(buf, one_size));
-      indirect_size += one_size;
-      free(buf);
+      ++len;
     }
   }
-  *size = direct_size + indirect_size;
-  *buf_out = (char *)malloc((*size) + 1);
-  memset(*buf_out, 0, (*size) + 1);
-  std::vector<std::string> bufs;
-  bufs.insert(bufs.end(), direct_bufs.begin(), direct_bufs.end());
-  bufs.insert(bufs.end(), indirect_bufs.begin(), indirect_bufs.end());
-  int curr_size = 0;
-  std::cout << "inode_manager: start merge " << std::endl;
-  for (auto buf : bufs)
-  {
-    int len = buf.size();
-    memcpy((*buf_out) + curr_size, buf.c_str(), len);
-    curr_size += len;
-  }
-  int adj_size = *size;
-  std::cout << "inode_manager: start adjust " << std::endl;
-  while ((*buf_out)[adj_size - 1] == '\0' && adj_size > 0)
-  {
-    adj_size -= 1;
-  }
-  *size = adj_size;
-  std::cout << "inode_manager: size " << adj_size << std::endl;
-  free(ino);
-  return;
+
+  std::map<blockid_t, uint32_t>::iterator prev = next;
+  if (prev != free_extents.begin() && (--prev)->first + prev->second == id)
+  {
+    start = prev->first;
+    len += prev->second;
+    index_erase(prev);
+  }
+  else
+  {
+    // block 0 is never free, so this stops before wrapping
+    while (id - start <= MIN_EXTENT && is_free(start - 1))
+    {
+      --start;
+      ++len;
+    }
+  }
+  index_insert(start, len);
+}
+
+// Mark [start, start + len) taken in the bitmap, whole words at a time,
+// and write each touched bitmap block once.
+void block_manager::mark_bits(blockid_t start, uint32_t len)
+{
+  blockid_t id = start, end = start + len;
+  for (; id < end && id % 64 != 0; ++id)
+  {
+    bitmap[id / 64] |= (uint64_t)1 << (id % 64);
+  }
+  for (; id + 64 <= end; id += 64)
+  {
+    bitmap[id / 64] = ~(uint64_t)0;
+  }
+  for (; id < end; ++id)
+  {
+    bitmap[id / 64] |= (uint64_t)1 << (id % 64);
+  }
+  for (blockid_t b = start - start % BPB(sb); b < end; b += BPB(sb))
+  {
+    write_bitmap_block(b);
+  }
+}
+
+// Allocate a free disk block.
+blockid_t
+block_manager::alloc_block()
+{
+  /*
+   * your code goes here.
+   * note: you should mark the corresponding bit in block bitmap when alloc.
+   * you need to think about which block you can start to be allocated.
+   */
+  std::lock_guard<std::mutex> lock(alloc_m);
+  return take_block();
+}
+
+// alloc_block with alloc_m held.
+blockid_t
+block_manager::take_block()
+{
+  // Blocks freed in the running transaction are not counted. Reusing
+  // them before it commits would leave them unsafe from a crash, so a
+  // disk that only has those is full; begin_op commits for them.
+  blockid_t id = sb.nfree > 0 ? find_free(cursor) : 0;
+  if (id == 0)
+  {
+    std::cout << "Cannot find free block" << std::endl;
+    return 0;
+  }
+  index_take(id, 1);
+  mark_bit(id);
+  --sb.nfree;
+  cursor = (id + 1 < sb.nblocks) ? id + 1 : sb.data_start;
+  return id;
+}
+
+// Allocate up to n physically contiguous blocks. The smallest free
+// extent that holds all n is used; if there is none, the largest one is
+// handed out and the caller asks again for the rest.
+// Return the first block and set len, or return 0 if the disk is full.
+blockid_t
+block_manager::alloc_extent(uint32_t n, uint32_t &len)
+{
+  len = 0;
+  if (n == 0)
+  {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(alloc_m);
+  if (free_sizes.empty())
+  {
+    // only short runs left, hand them out one block at a time
+    blockid_t id = take_block();
+    len = (id != 0);
+    return id;
+  }
+  std::set<std::pair<uint32_t, blockid_t> >::iterator it =
+      free_sizes.lower_bound(std::make_pair(n, (blockid_t)0));
+  if (it == free_sizes.end())
+  {
+    --it;
+  }
+  blockid_t start = it->second;
+  len = std::min(n, it->first);
+  index_take(start, len);
+  mark_bits(start, len);
+  sb.nfree -= len;
+  return start;
+}
+
+void block_manager::free_block(uint32_t id)
+{
+  /*
+   * your code goes here.
+   * note: you should unmark the corresponding bit in the block bitmap when free.
+   */
+  std::lock_guard<std::mutex> lock(alloc_m);
+  if (id < sb.data_start || id >= sb.nblocks || is_free(id))
+  {
+    return;
+  }
+  // With a journal the block stays taken until the transaction freeing it
+  // commits. Reused earlier, it could be overwritten in place while the
+  // disk still says it belongs to its old owner.
+  if (log != NULL)
+  {
+    // Its bitmap block joins the transaction now, so that releasing it
+    // at commit logs nothing the operation did not reserve.
+    if (freed.empty() || freed.back() / BPB(sb) != id / BPB(sb))
+    {
+      write_bitmap_block(id);
+    }
+    freed.push_back(id);
+    return;
+  }
+  release_block(id);
+}
+
+// Make block id free again. Called with alloc_m held. Whoever allocates
+// it next writes all of it, so it is not zeroed.
+void block_manager::release_block(blockid_t id)
+{
+  d->discard(id);
+  unmark_bit(id);
+  index_give(id);
+  ++sb.nfree;
+}
+
+// Release the blocks freed in the running transaction just before it
+// commits. Their copies on a log-structured disk stay live until the
+// commit is on disk, so the cleaner cannot hand their segment to other
+// blocks while a crash would still leave them in use. Called with
+// alloc_m held.
+void block_manager::release_freed()
+{
+  for (size_t i = 0; i < freed.size(); ++i)
+  {
+    if (!is_free(freed[i]))
+    {
+      unmark_bit(freed[i]);
+      index_give(freed[i]);
+      ++sb.nfree;
+      released.push_back(freed[i]);
+    }
+  }
+  freed.clear();
+}
+
+// The commit is on disk: drop the copies of the blocks it freed, and let
+// the segments emptied before it be reused.
+void block_manager::committed()
+{
+  std::lock_guard<std::mutex> lock(alloc_m);
+  for (size_t i = 0; i < released.size(); ++i)
+  {
+    d->discard(released[i]);
+  }
+  released.clear();
+  if (segs != NULL)
+  {
+    segs->committed();
+  }
+}
+
+// Parse a byte count such as "4096", "64M" or "200G" from the environment.
+static uint64_t env_size(const char *name, uint64_t def)
+{
+  const char *val = getenv(name);
+  if (val == NULL || *val == '\0')
+  {
+    return def;
+  }
+  char *end = NULL;
+  uint64_t n = strtoull(val, &end, 0);
+  switch (*end)
+  {
+  case 'k': case 'K': n <<= 10; break;
+  case 'm': case 'M': n <<= 20; break;
+  case 'g': case 'G': n <<= 30; break;
+  case 't': case 'T': n <<= 40; break;
+  }
+  return n;
+}
+
+// The layout of disk should be like this:
+// |<-sb->|<-journal->|<-free block bitmap->|<-inode bitmap->|<-inode table->|<-data->|
+//
+// Set CHFS_IMAGE to keep the disk in an image file. An image that already
+// carries a superblock is mounted as is, anything else gets formatted.
+// CHFS_DISK_SIZE, CHFS_BLOCK_SIZE, CHFS_INODE_NUM, CHFS_JOURNAL_SIZE and
+// CHFS_SEGMENT_SIZE pick the geometry of a new disk and are ignored when
+// mounting an existing one.
+//
+// On a disk with a journal, blocks are written back by journal commits,
+// every CHFS_FLUSH_MS, instead of by the buffer cache.
+block_manager::block_manager()
+{
+  uint64_t size = env_size("CHFS_DISK_SIZE", DISK_SIZE);
+  uint32_t block_size = env_size("CHFS_BLOCK_SIZE", BLOCK_SIZE);
+  uint32_t ninodes = env_size("CHFS_INODE_NUM", INODE_NUM);
+  uint64_t journal_size = env_size("CHFS_JOURNAL_SIZE", std::min<uint64_t>(JOURNAL_SIZE, size / 64));
+  uint64_t segment_size = env_size("CHFS_SEGMENT_SIZE", 0);
+  int flush_ms = env_size("CHFS_FLUSH_MS", FLUSH_MS);
+
+  d = new disk(getenv("CHFS_IMAGE"), size);
+  d->start_io(getenv("CHFS_IO"));
+  log = NULL;
+  segs = NULL;
+  formatted = false;
+  if (!mount())
+  {
+    mkfs(block_size, ninodes, journal_size, segment_size);
+    formatted = true;
+  }
+  cursor = sb.data_start;
+
+  cache = new buffer_cache(d, sb.block_size, env_size("CHFS_CACHE_SIZE", CACHE_SIZE),
+                           log != NULL ? 0 : flush_ms);
+  if (log != NULL)
+  {
+    log->start_logging(cache, flush_ms, [this] {
+      std::lock_guard<std::mutex> lock(alloc_m);
+      release_freed();
+    }, [this] { committed(); });
+  }
+  if (segs != NULL)
+  {
+    segs->start_cleaner();
+  }
+}
+
+block_manager::~block_manager()
+{
+  sync();
+  delete log;
+  delete cache;
+  if (segs != NULL)
+  {
+    delete segs;
+    d->set_segments(NULL);
+  }
+  delete d;
+}
+
+// Load the superblock and adopt its geometry.
+// Return false if the disk does not hold a usable file system.
+bool block_manager::mount()
+{
+  if (d->is_fresh())
+  {
+    return false;
+  }
+
+  char buf[MIN_BLOCK_SIZE];
+  d->read_block(SBLOCK, buf);
+  memcpy(&sb, buf, sizeof(sb));
+  if (sb.magic != SB_MAGIC)
+  {
+    return false;
+  }
+  if (sb.size > d->size() || (uint64_t)sb.nblocks * sb.block_size > sb.size ||
+      sb.data_start >= sb.nblocks || !d->set_block_size(sb.block_size) ||
+      (sb.journal_len > 0 && sb.journal_start + sb.journal_len > sb.bmap_start) ||
+      (sb.seg_start > 0 && (sb.seg_blocks < MIN_SEG_BLOCKS ||
+                            (uint64_t)sb.seg_start + (uint64_t)sb.nsegs * sb.seg_blocks > d->size() / sb.block_size)))
+  {
+    printf("\tbm: bad superblock, reformatting\n");
+    return false;
+  }
+  if (sb.seg_start > 0)
+  {
+    segs = new segment_log(d, sb);
+    if (!segs->load())
+    {
+      printf("\tbm: no segment map checkpoint, reformatting\n");
+      delete segs;
+      segs = NULL;
+      return false;
+    }
+    d->set_segments(segs);
+  }
+  if (sb.journal_len > 0)
+  {
+    log = new journal(d, sb.journal_start, sb.journal_len, sb.block_size);
+  }
+  load_bitmap();
+  if (segs != NULL)
+  {
+    // drop what was freed since the checkpoint before replay needs room
+    segs->discard_free(bitmap.data(), sb.data_start);
+  }
+  if (log != NULL)
+  {
+    // finish the last transaction before reading anything else it changed
+    log->replay(sb.nblocks);
+  }
+  build_extent_index();
+  return true;
+}
+
+// Read the whole bitmap into memory. The free count in the superblock is
+// only written back on a clean unmount, so recount it from the bitmap.
+// Like mkfs this runs before the buffer cache is up and uses the disk.
+void block_manager::load_bitmap()
+{
+  uint32_t nbmap = sb.imap_start - sb.bmap_start;
+  bitmap.assign((size_t)nbmap * sb.block_size / 8, 0);
+  d->read_range(sb.bmap_start, nbmap, (char *)bitmap.data());
+  if (log != NULL)
+  {
+    // as the logged transaction, replayed later, leaves it
+    log->overlay(sb.nblocks, sb.bmap_start, nbmap, (char *)bitmap.data());
+  }
+
+  uint32_t nfree = 0;
+  for (size_t i = 0; i < bitmap.size(); ++i)
+  {
+    nfree += __builtin_popcountll(~bitmap[i]);
+  }
+  if (nfree != sb.nfree)
+  {
+    printf("\tbm: free block count %u, bitmap says %u\n", sb.nfree, nfree);
+    sb.nfree = nfree;
+  }
+}
+
+// Format the disk: compute the layout for the given geometry, write the
+// superblock, an empty journal and a bitmap in which the metadata blocks
+// are taken. The inode table starts out zeroed.
+//
+// A log-structured disk keeps the superblock and the journal in place and
+// puts the segment map checkpoints and the segments behind them:
+// |<-sb->|<-journal->|<-checkpoint->|<-checkpoint->|<-segments->|
+// The bitmaps, inode table and data then live in the segments.
+void block_manager::mkfs(uint32_t block_size, uint32_t ninodes, uint64_t journal_size, uint64_t segment_size)
+{
+  if (!d->set_block_size(block_size))
+  {
+    printf("\tbm: unsupported block size %u, using %u\n", block_size, BLOCK_SIZE);
+    block_size = BLOCK_SIZE;
+    d->set_block_size(block_size);
+  }
+
+  memset(&sb, 0, sizeof(sb));
+  sb.magic = SB_MAGIC;
+  sb.block_size = block_size;
+  uint64_t nblocks = d->size() / block_size;
+  if (nblocks > MAX_NBLOCKS)
+  {
+    printf("\tbm: disk of %llu blocks is more than block numbers reach, using %u\n",
+           (unsigned long long)nblocks, (uint32_t)MAX_NBLOCKS);
+    nblocks = MAX_NBLOCKS;
+  }
+  sb.nblocks = nblocks;
+  sb.size = (uint64_t)sb.nblocks * block_size;
+  sb.ninodes = ninodes;
+  sb.journal_start = SBLOCK + 1;
+  sb.journal_len = journal_size / block_size;
+  if (sb.journal_len < MIN_JOURNAL_BLOCKS)
+  {
+    sb.journal_len = 0;
+  }
+  sb.bmap_start = sb.journal_start + sb.journal_len;
+  uint32_t seg_blocks = segment_size / block_size;
+  if (seg_blocks >= MIN_SEG_BLOCKS)
+  {
+    // a map entry for every block of the disk is more than enough
+    uint32_t ckpt_len = 1 + ((uint64_t)sb.nblocks * sizeof(uint32_t) + block_size - 1) / block_size;
+    uint32_t seg_start = sb.bmap_start + 2 * ckpt_len;
+    uint32_t nsegs = seg_start < sb.nblocks ? (sb.nblocks - seg_start) / seg_blocks : 0;
+    if (nsegs > 4 * SEG_RESERVE)
+    {
+      sb.ckpt_start = sb.bmap_start;
+      sb.ckpt_len = ckpt_len;
+      sb.seg_start = seg_start;
+      sb.seg_blocks = seg_blocks;
+      sb.nsegs = nsegs;
+      sb.nblocks = sb.bmap_start + (uint64_t)nsegs *
+                   (seg_blocks - segment_log::summary_blocks(seg_blocks, block_size)) * SEG_FILL / 100;
+      segs = new segment_log(d, sb);
+      segs->format();
+      d->set_segments(segs);
+    }
+    else
+    {
+      printf("\tbm: disk too small for segments of %u blocks, writing in place\n", seg_blocks);
+    }
+  }
+  sb.imap_start = sb.bmap_start + (sb.nblocks + BPB(sb) - 1) / BPB(sb);
+  // inode numbers start from 1, bit and slot 0 are never used
+  sb.inode_start = sb.imap_start + (ninodes + BPB(sb)) / BPB(sb);
+  sb.data_start = sb.inode_start + (ninodes + IPB(sb)) / IPB(sb);
+  sb.nfree = sb.nblocks - sb.data_start;
+  sb.nfree_inodes = ninodes;
+
+  // Everything before the data region, and the padding bits past the
+  // last block, are never handed out. The inode bitmap is left to the
+  // inode layer.
+  uint32_t nbmap = sb.imap_start - sb.bmap_start;
+  bitmap.assign((size_t)nbmap * sb.block_size / 8, 0);
+  for (size_t i = 0; i < (size_t)nbmap * BPB(sb); ++i)
+  {
+    if (i < sb.data_start || i >= sb.nblocks)
+    {
+      bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+  }
+  d->write_range(sb.bmap_start, nbmap, (const char *)bitmap.data());
+  build_extent_index();
+  if (sb.journal_len > 0)
+  {
+    log = new journal(d, sb.journal_start, sb.journal_len, sb.block_size);
+    log->format();
+  }
+  write_super();
+}
+
+void block_manager::write_super()
+{
+  char buf[MAX_BLOCK_SIZE] = {0};
+  memcpy(buf, &sb, sizeof(sb));
+  d->write_block(SBLOCK, buf);
+}
+
+void block_manager::read_block(uint32_t id, char *buf) const
+{
+  cache->read(id, buf);
+}
+
+void block_manager::write_block(uint32_t id, const char *buf)
+{
+  cache->write(id, buf);
+}
+
+// Read or write n consecutive blocks from id on. Used for whole extents of
+// file data, which are copied to or from the disk in one go rather than
+// a block at a time through the cache.
+void block_manager::read_range(uint32_t id, uint32_t n, char *buf) const
+{
+  cache->read_range(id, n, buf);
+}
+
+bool block_manager::write_range(uint32_t id, uint32_t n, const char *buf)
+{
+  return cache->write_range(id, n, buf);
+}
+
+// read_blocks and write_blocks through the cache, which is not filled
+// by them, like read_range and write_range. Writes return false if a
+// log-structured disk had no room for them.
+void block_manager::read_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt)
+{
+  io_batch b;
+  batch_blocks(b, false, ids, n, iov, iovcnt, sb.block_size);
+  cache->submit(b);
+  cache->complete(b);
+}
+
+bool block_manager::write_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt)
+{
+  io_batch b;
+  batch_blocks(b, true, ids, n, iov, iovcnt, sb.block_size);
+  cache->submit(b);
+  return cache->complete(b);
+}
+
+// Batched read_range and write_range: submit puts every request of b in
+// flight, complete waits for them.
+void block_manager::submit(io_batch &b)
+{
+  cache->submit(b);
+}
+
+bool block_manager::complete(io_batch &b)
+{
+  return cache->complete(b);
+}
+
+// Pin block id in the cache, to read or change it in place.
+buf_ref block_manager::get_block(uint32_t id)
+{
+  return cache->get(id);
+}
+
+// Pin block id if it is cached, without reading it in.
+buf_ref block_manager::get_resident(uint32_t id)
+{
+  return cache->get_resident(id);
+}
+
+// The disk's own copy of block id. Only current if the block is not
+// cached, see get_resident. NULL if the block has no fixed place.
+const char *block_manager::block_data(uint32_t id) const
+{
+  return d->block_data(id);
+}
+
+// Commit the running transaction, write dirty buffers and the
+// superblock back and flush the disk. A log-structured disk also
+// checkpoints its map, so the next mount has nothing to roll forward.
+void block_manager::sync()
+{
+  if (log != NULL)
+  {
+    log->commit();
+  }
+  cache->flush();
+  {
+    std::lock_guard<std::mutex> lock(alloc_m);
+    write_super();
+  }
+  d->sync();
+  if (segs != NULL)
+  {
+    segs->checkpoint();
+  }
+}
+
+// Read blocks into the cache ahead of use.
+void block_manager::prefetch(const blockid_t *ids, uint32_t n)
+{
+  cache->prefetch(ids, n);
+}
+
+void block_manager::get_cache_stats(cache_stats &st) const
+{
+  cache->get_stats(st);
+}
+
+// Bracket one file system operation that logs at most nblocks blocks.
+// The blocks it changes reach the disk atomically, together with those of
+// the operations running alongside, when the journal next commits.
+// Without a journal these do nothing. begin_op returns -ENOSPC, and the
+// operation must not run, if the journal cannot take it.
+int block_manager::begin_op(uint32_t nblocks)
+{
+  if (log == NULL)
+  {
+    return 0;
+  }
+  bool starved;
+  {
+    std::lock_guard<std::mutex> lock(alloc_m);
+    starved = freed.size() > sb.nfree;
+  }
+  if (starved)
+  {
+    // most free space waits for the running transaction to commit
+    log->commit();
+  }
+  return log->begin_op(nblocks);
+}
+
+void block_manager::end_op(uint32_t nblocks)
+{
+  if (log != NULL)
+  {
+    log->end_op(nblocks);
+  }
+}
+
+// Most blocks one operation may log; unbounded without a journal.
+uint32_t block_manager::max_op() const
+{
+  return log != NULL ? log->max_op() : UINT32_MAX;
+}
+
+// inode layer -----------------------------------------
+
+struct icache_entry
+{
+  uint32_t inum;
+  int refs;
+  bool loading; // ino is being read in, see inode_cache::get
+  struct inode ino;
+  std::shared_mutex lock;
+  std::list<struct icache_entry *>::iterator lru; // valid while refs == 0
+};
+
+inode_ref &inode_ref::operator=(inode_ref &&other)
+{
+  if (this != &other)
+  {
+    release();
+    cache = other.cache;
+    e = other.e;
+    other.e = NULL;
+  }
+  return *this;
+}
+
+struct inode *inode_ref::get() const
+{
+  return &e->ino;
+}
+
+std::shared_mutex &inode_ref::lock() const
+{
+  return e->lock;
+}
+
+void inode_ref::release()
+{
+  if (e != NULL)
+  {
+    cache->unref(e);
+    e = NULL;
+  }
+}
+
+inode_cache::inode_cache(block_manager *bm, size_t limit)
+  : bm(bm), limit(limit)
+{
+}
+
+inode_cache::~inode_cache()
+{
+  std::unordered_map<uint32_t, struct icache_entry *>::iterator it;
+  for (it = map.begin(); it != map.end(); ++it)
+  {
+    delete it->second;
+  }
+}
+
+inode_ref inode_cache::get(uint32_t inum)
+{
+  std::unique_lock<std::mutex> lock(m);
+  std::unordered_map<uint32_t, struct icache_entry *>::iterator it = map.find(inum);
+  struct icache_entry *e;
+  if (it != map.end())
+  {
+    e = it->second;
+    if (e->refs++ == 0)
+    {
+      lru.erase(e->lru);
+    }
+    cv.wait(lock, [e] { return !e->loading; });
+    return inode_ref(this, e);
+  }
+
+  // Enter the inode before reading it, so that the read, which may go
+  // to the disk, does not hold up lookups of other inodes.
+  e = new struct icache_entry;
+  e->inum = inum;
+  e->refs = 1;
+  e->loading = true;
+  map[inum] = e;
+  lock.unlock();
+  buf_ref b = bm->get_block(IBLOCK(inum, bm->sb));
+  lock.lock();
+  e->ino = *((struct inode *)b.data() + inum % IPB(bm->sb));
+  e->loading = false;
+  cv.notify_all();
+  return inode_ref(this, e);
+}
+
+// Write ino to its disk block, and to the in-core copy if ino is not it.
+void inode_cache::put(uint32_t inum, const struct inode *ino)
+{
+  {
+    std::unique_lock<std::mutex> lock(m);
+    std::unordered_map<uint32_t, struct icache_entry *>::iterator it = map.find(inum);
+    // a copy still being read in would miss this write
+    while (it != map.end() && it->second->loading)
+    {
+      cv.wait(lock);
+      it = map.find(inum);
+    }
+    if (it != map.end() && &it->second->ino != ino)
+    {
+      it->second->ino = *ino;
+    }
+  }
+
+  buf_ref b = bm->get_block(IBLOCK(inum, bm->sb));
+  *((struct inode *)b.data() + inum % IPB(bm->sb)) = *ino;
+  b.mark_dirty();
+}
+
+void inode_cache::unref(struct icache_entry *e)
+{
+  std::lock_guard<std::mutex> lock(m);
+  if (--e->refs > 0)
+  {
+    return;
+  }
+  lru.push_front(e);
+  e->lru = lru.begin();
+  while (lru.size() > limit)
+  {
+    struct icache_entry *victim = lru.back();
+    lru.pop_back();
+    map.erase(victim->inum);
+    delete victim;
+  }
+}
+
+inode_manager::inode_manager()
+{
+  bm = new block_manager();
+  bs = bm->sb.block_size;
+  icache = new inode_cache(bm, ICACHE_SIZE);
+  icursor = 1;
+  if (!bm->formatted)
+  {
+    // existing image, the root directory is already there
+    load_imap();
+    return;
+  }
+  format_imap();
+  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
+  if (root_dir != 1)
+  {
+    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+    exit(0);
+  }
+  // a new file system is complete on disk before anything else changes it
+  bm->sync();
+}
+
+inode_manager::~inode_manager()
+{
+  delete icache;
+  delete bm;
+}
+
+// Write an empty inode bitmap. Inode 0 and the padding bits past the last
+// inode are taken for good.
+void inode_manager::format_imap()
+{
+  uint32_t nimap = bm->sb.inode_start - bm->sb.imap_start;
+  imap.assign((size_t)nimap * bs / 8, 0);
+  for (size_t i = 0; i < (size_t)nimap * BPB(bm->sb); ++i)
+  {
+    if (i == 0 || i > bm->sb.ninodes)
+    {
+      imap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+  }
+  for (uint32_t i = 0; i < nimap; ++i)
+  {
+    bm->write_block(bm->sb.imap_start + i, (const char *)&imap[(size_t)i * bs / 8]);
+  }
+  bm->sb.nfree_inodes = bm->sb.ninodes;
+}
+
+// Read the inode bitmap into memory and recount the free inodes, which
+// the superblock only has right after a clean unmount.
+void inode_manager::load_imap()
+{
+  uint32_t nimap = bm->sb.inode_start - bm->sb.imap_start;
+  imap.assign((size_t)nimap * bs / 8, 0);
+  bm->read_range(bm->sb.imap_start, nimap, (char *)imap.data());
+
+  uint32_t nfree = 0;
+  for (size_t i = 0; i < imap.size(); ++i)
+  {
+    nfree += __builtin_popcountll(~imap[i]);
+  }
+  if (nfree != bm->sb.nfree_inodes)
+  {
+    printf("\tim: free inode count %u, bitmap says %u\n", bm->sb.nfree_inodes, nfree);
+    bm->sb.nfree_inodes = nfree;
+  }
+}
+
+// Write the bitmap block holding the bit for inode inum back to disk.
+void inode_manager::write_imap_block(uint32_t inum)
+{
+  uint32_t index = inum / BPB(bm->sb);
+  bm->write_block(bm->sb.imap_start + index, (const char *)&imap[(size_t)index * bs / 8]);
+}
+
+/* Create a new file.
+ * Return its inum. */
+uint32_t
+inode_manager::alloc_inode(uint32_t type)
+{
+  /*
+   * your code goes here.
+   * note: the normal inode block should begin from the 2nd inode block.
+   * the 1st is used for root_dir, see inode_manager::inode_manager().
+   */
+  if (type != extent_protocol::T_DIR && type != extent_protocol::T_FILE && type != extent_protocol::T_LNK)
+  {
+    return 0;
+  }
+
+  uint32_t id;
+  {
+    std::lock_guard<std::mutex> lock(imap_m);
+    id = bm->sb.nfree_inodes > 0 ? find_free_inode() : 0;
+    if (id == 0)
+    {
+      throw std::bad_alloc();
+    }
+    imap[id / 64] |= (uint64_t)1 << (id % 64);
+    write_imap_block(id);
+    --bm->sb.nfree_inodes;
+    icursor = (id + 1 > bm->sb.ninodes) ? 1 : id + 1;
+  }
+  inode_ref ino = get_inode(id);
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+  ino->nblocks = 0;
+  ino->size = 0;
+  ino->flags = (type == extent_protocol::T_DIR) ? 0 : INODE_EXTENTS;
+  uint32_t curr_time = (uint32_t)time(NULL);
+  ino->atime = curr_time;
+  ino->ctime = curr_time;
+  ino->mtime = curr_time;
+  memset(ino->blocks, 0, sizeof(ino->blocks));
+  ino->type = type;
+  put_inode(id, ino.get());
+  return id;
+}
+
+// The caller holds inum's lock, as remove_file does.
+void inode_manager::free_inode(uint32_t inum)
+{
+  /*
+   * your code goes here.
+   * note: you need to check if the inode is already a freed one;
+   * if not, clear it, and remember to write back to disk.
+   */
+  inode_ref ino = get_inode(inum);
+  if (ino->type != 0)
+  {
+    memset(ino.get(), 0, sizeof(struct inode));
+    put_inode(inum, ino.get());
+    std::lock_guard<std::mutex> lock(imap_m);
+    imap[inum / 64] &= ~((uint64_t)1 << (inum % 64));
+    write_imap_block(inum);
+    ++bm->sb.nfree_inodes;
+  }
+  return;
+}
+
+/* Return a reference to the in-core inode inum, empty if inum is out of
+ * range. The reference is dropped when the handle goes out of scope. */
+inode_ref
+inode_manager::get_inode(uint32_t inum) const
+{
+  // printf("\tim: get_inode %d\n", inum);
+  if (inum > bm->sb.ninodes || inum < 1)
+  {
+    return inode_ref();
+  }
+  return icache->get(inum);
+}
+
+void inode_manager::put_inode(uint32_t inum, const struct inode *ino)
+{
+  printf("\tim: put_inode %d\n", inum);
+  if (ino == NULL || inum > bm->sb.ninodes || inum < 1)
+  {
+    return;
+  }
+  icache->put(inum, ino);
+}
+
+// Find a free inode from the cursor on. Return 0 if there is none.
+uint32_t inode_manager::find_free_inode() const
+{
+  return find_clear_bit(imap.data(), imap.size(), icursor);
+}
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Locate logical block n of a file: the slot of ino->blocks whose tree
+// holds it, the depth of that tree (0 for a direct block) and n's index
+// within the tree. Return false if n is past MAXFILE.
+bool inode_manager::bmap_locate(uint32_t n, uint32_t &slot, uint32_t &depth, uint64_t &off) const
+{
+  if (n < NDIRECT)
+  {
+    slot = n;
+    depth = 0;
+    off = 0;
+    return true;
+  }
+  off = n - NDIRECT;
+  uint64_t span = NINDIRECT(bm->sb);
+  for (depth = 1; depth <= NLEVELS; ++depth)
+  {
+    if (off < span)
+    {
+      slot = NDIRECT + depth - 1;
+      return true;
+    }
+    off -= span;
+    span *= NINDIRECT(bm->sb);
+  }
+  return false;
+}
+
+// Number of data blocks under one entry of an index block at depth.
+uint64_t inode_manager::bmap_span(uint32_t depth) const
+{
+  uint64_t span = 1;
+  while (--depth > 0)
+  {
+    span *= NINDIRECT(bm->sb);
+  }
+  return span;
+}
+
+// Return the disk block holding logical block n, 0 if there is none.
+// If run is given it is set to how many blocks from n on are known to
+// follow on disk, n included.
+blockid_t inode_manager::bmap(const struct inode *ino, uint32_t n, uint32_t *run) const
+{
+  if (ino->flags & INODE_EXTENTS)
+  {
+    return ext_bmap(ino, n, run);
+  }
+  if (run != NULL)
+  {
+    *run = 1;
+  }
+  uint32_t slot, depth;
+  uint64_t off;
+  if (!bmap_locate(n, slot, depth, off))
+  {
+    return 0;
+  }
+  blockid_t id = ino->blocks[slot];
+  for (; depth > 0 && id != 0; --depth)
+  {
+    uint64_t span = bmap_span(depth);
+    buf_ref b = bm->get_block(id);
+    id = ((blockid_t *)b.data())[off / span];
+    off %= span;
+  }
+  return id;
+}
+
+// Map logical block n to disk block id, allocating index blocks on the
+// way down as needed.
+void inode_manager::bmap_set(struct inode *ino, uint32_t n, blockid_t id)
+{
+  uint32_t slot, depth;
+  uint64_t off;
+  if (!bmap_locate(n, slot, depth, off))
+  {
+    throw std::bad_alloc();
+  }
+  if (depth == 0)
+  {
+    ino->blocks[slot] = id;
+    return;
+  }
+  if (ino->blocks[slot] == 0)
+  {
+    ino->blocks[slot] = alloc_index_block();
+  }
+  buf_ref b = bm->get_block(ino->blocks[slot]);
+  for (; depth > 1; --depth)
+  {
+    uint64_t span = bmap_span(depth);
+    blockid_t *entry = (blockid_t *)b.data() + off / span;
+    off %= span;
+    if (*entry == 0)
+    {
+      *entry = alloc_index_block();
+      b.mark_dirty();
+    }
+    b = bm->get_block(*entry);
+  }
+  ((blockid_t *)b.data())[off] = id;
+  b.mark_dirty();
+}
+
+blockid_t inode_manager::alloc_index_block()
+{
+  blockid_t id = bm->alloc_block();
+  if (id == 0)
+  {
+    throw std::bad_alloc();
+  }
+  char zeros[MAX_BLOCK_SIZE] = {0};
+  bm->write_block(id, zeros);
+  return id;
+}
+
+// Free the blocks of ino from logical block `from` on, together with the
+// index blocks left with nothing under them.
+void inode_manager::bmap_free(struct inode *ino, uint32_t from)
+{
+  if (ino->flags & INODE_EXTENTS)
+  {
+    if (ext_free((char *)ino->blocks, from))
+    {
+      // empty again, back to an inline leaf
+      ((struct extent_header *)ino->blocks)->depth = 0;
+    }
+    return;
+  }
+  for (uint32_t i = from; i < NDIRECT; ++i)
+  {
+    if (ino->blocks[i] != 0)
+    {
+      bm->free_block(ino->blocks[i]);
+      ino->blocks[i] = 0;
+    }
+  }
+  uint64_t base = NDIRECT;
+  for (uint32_t depth = 1; depth <= NLEVELS; ++depth)
+  {
+    uint32_t slot = NDIRECT + depth - 1;
+    uint64_t span = bmap_span(depth) * NINDIRECT(bm->sb);
+    if (ino->blocks[slot] != 0 && base + span > from)
+    {
+      if (bmap_free_tree(ino->blocks[slot], depth, from > base ? from - base : 0))
+      {
+        bm->free_block(ino->blocks[slot]);
+        ino->blocks[slot] = 0;
+      }
+    }
+    base += span;
+  }
+}
+
+// Free everything from entry `from` on under index block id at depth.
+// Return true if nothing is left under it.
+bool inode_manager::bmap_free_tree(blockid_t id, uint32_t depth, uint64_t from)
+{
+  uint64_t span = bmap_span(depth);
+  buf_ref b = bm->get_block(id);
+  blockid_t *entries = (blockid_t *)b.data();
+  for (uint32_t i = from / span; i < NINDIRECT(bm->sb); ++i)
+  {
+    if (entries[i] == 0)
+    {
+      continue;
+    }
+    uint64_t lo = i * span;
+    if (depth == 1 || bmap_free_tree(entries[i], depth - 1, from > lo ? from - lo : 0))
+    {
+      bm->free_block(entries[i]);
+      entries[i] = 0;
+      b.mark_dirty();
+    }
+  }
+  return from == 0;
+}
+
+// Map logical blocks [n, n + len) of ino to disk blocks [start, start + len).
+void inode_manager::bmap_append(struct inode *ino, uint32_t n, blockid_t start, uint32_t len)
+{
+  if (ino->flags & INODE_EXTENTS)
+  {
+    struct extent e = {n, start, len};
+    ext_append(ino, e);
+    return;
+  }
+  for (uint32_t i = 0; i < len; ++i)
+  {
+    bmap_set(ino, n + i, start + i);
+  }
+}
+
+blockid_t inode_manager::ext_bmap(const struct inode *ino, uint32_t n, uint32_t *run) const
+{
+  const char *node = (const char *)ino->blocks;
+  buf_ref b;
+  while (true)
+  {
+    const struct extent_header *h = (const struct extent_header *)node;
+    // find the last entry starting at or before n
+    uint32_t lo = 0, hi = h->entries;
+    if (h->depth == 0)
+    {
+      const struct extent *ex = (const struct extent *)(h + 1);
+      while (lo < hi)
+      {
+        uint32_t mid = (lo + hi) / 2;
+        if (ex[mid].lblk <= n)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      if (lo == 0 || n >= ex[lo - 1].lblk + ex[lo - 1].len)
+      {
+        if (run != NULL)
+        {
+          *run = 1;
+        }
+        return 0;
+      }
+      if (run != NULL)
+      {
+        *run = ex[lo - 1].lblk + ex[lo - 1].len - n;
+      }
+      return ex[lo - 1].pblk + (n - ex[lo - 1].lblk);
+    }
+    const struct extent_idx *idx = (const struct extent_idx *)(h + 1);
+    while (lo < hi)
+    {
+      uint32_t mid = (lo + hi) / 2;
+      if (idx[mid].lblk <= n)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == 0)
+    {
+      if (run != NULL)
+      {
+        *run = 1;
+      }
+      return 0;
+    }
+    b = bm->get_block(idx[lo - 1].child);
+    node = b.data();
+  }
+}
+
+// Add extent e, which lies past every extent under node, to the subtree
+// at node. If node has no room, a new sibling of the same depth holding e
+// is made instead and returned in split for the parent to link in; the
+// return value says so.
+bool inode_manager::ext_insert(char *node, uint32_t size, const struct extent &e, struct extent_idx &split)
+{
+  struct extent_header *h = (struct extent_header *)node;
+  if (h->depth == 0)
+  {
+    struct extent *ex = (struct extent *)(h + 1);
+    if (h->entries > 0)
+    {
+      struct extent &last = ex[h->entries - 1];
+      if (last.lblk + last.len == e.lblk && last.pblk + last.len == e.pblk)
+      {
+        last.len += e.len;
+        return false;
+      }
+    }
+    if (h->entries < EXT_MAX(size, 0))
+    {
+      ex[h->entries++] = e;
+      return false;
+    }
+    split.lblk = e.lblk;
+    split.child = alloc_ext_node(0);
+    buf_ref b = bm->get_block(split.child);
+    struct extent_header *nh = (struct extent_header *)b.data();
+    *(struct extent *)(nh + 1) = e;
+    nh->entries = 1;
+    b.mark_dirty();
+    return true;
+  }
+
+  struct extent_idx *idx = (struct extent_idx *)(h + 1);
+  {
+    buf_ref b = bm->get_block(idx[h->entries - 1].child);
+    bool full = ext_insert(b.data(), bs, e, split);
+    b.mark_dirty();
+    if (!full)
+    {
+      return false;
+    }
+  }
+  if (h->entries < EXT_MAX(size, h->depth))
+  {
+    idx[h->entries++] = split;
+    return false;
+  }
+  blockid_t id = alloc_ext_node(h->depth);
+  buf_ref b = bm->get_block(id);
+  struct extent_header *nh = (struct extent_header *)b.data();
+  *(struct extent_idx *)(nh + 1) = split;
+  nh->entries = 1;
+  b.mark_dirty();
+  split.child = id;
+  return true;
+}
+
+void inode_manager::ext_append(struct inode *ino, const struct extent &e)
+{
+  char *root = (char *)ino->blocks;
+  struct extent_idx split;
+  if (!ext_insert(root, EXT_ROOT_SIZE, e, split))
+  {
+    return;
+  }
+
+  // The root is full: move it out to a block and add a level above it.
+  struct extent_header *h = (struct extent_header *)root;
+  blockid_t id = alloc_ext_node(h->depth);
+  buf_ref b = bm->get_block(id);
+  memcpy(b.data(), root, EXT_ROOT_SIZE);
+  b.mark_dirty();
+  struct extent_idx *idx = (struct extent_idx *)(h + 1);
+  uint32_t first = (h->depth == 0) ? ((struct extent *)(h + 1))->lblk : idx[0].lblk;
+  h->depth += 1;
+  h->entries = 2;
+  idx[0].lblk = first;
+  idx[0].child = id;
+  idx[1] = split;
+}
+
+// Free the blocks from logical block `from` on under node, and the tree
+// blocks left empty. Return true if node itself is left empty.
+bool inode_manager::ext_free(char *node, uint32_t from)
+{
+  struct extent_header *h = (struct extent_header *)node;
+  if (h->depth == 0)
+  {
+    struct extent *ex = (struct extent *)(h + 1);
+    while (h->entries > 0)
+    {
+      struct extent &e = ex[h->entries - 1];
+      uint32_t keep = (e.lblk >= from) ? 0 : MIN(from - e.lblk, e.len);
+      for (uint32_t i = keep; i < e.len; ++i)
+      {
+        bm->free_block(e.pblk + i);
+      }
+      e.len = keep;
+      if (keep > 0)
+      {
+        break;
+      }
+      h->entries--;
+    }
+    return h->entries == 0;
+  }
+
+  struct extent_idx *idx = (struct extent_idx *)(h + 1);
+  while (h->entries > 0)
+  {
+    blockid_t child = idx[h->entries - 1].child;
+    bool empty;
+    {
+      buf_ref b = bm->get_block(child);
+      empty = ext_free(b.data(), from);
+      b.mark_dirty();
+    }
+    if (!empty)
+    {
+      break;
+    }
+    bm->free_block(child);
+    h->entries--;
+  }
+  return h->entries == 0;
+}
+
+void inode_manager::ext_collect(const char *node, std::vector<struct extent> &extents) const
+{
+  const struct extent_header *h = (const struct extent_header *)node;
+  if (h->depth == 0)
+  {
+    const struct extent *ex = (const struct extent *)(h + 1);
+    extents.insert(extents.end(), ex, ex + h->entries);
+    return;
+  }
+  const struct extent_idx *idx = (const struct extent_idx *)(h + 1);
+  for (uint32_t i = 0; i < h->entries; ++i)
+  {
+    buf_ref b = bm->get_block(idx[i].child);
+    ext_collect(b.data(), extents);
+  }
+}
+
+blockid_t inode_manager::alloc_ext_node(uint16_t depth)
+{
+  blockid_t id = alloc_index_block();
+  buf_ref b = bm->get_block(id);
+  ((struct extent_header *)b.data())->depth = depth;
+  b.mark_dirty();
+  return id;
+}
+
+// Append the disk blocks of inum, in file order, to blocks.
+void inode_manager::read_blockid(uint32_t inum, std::vector<blockid_t> &blocks) const
+{
+  inode_ref ino = get_inode(inum);
+  if (!ino)
+  {
+    return;
+  }
+  if (ino->flags & INODE_EXTENTS)
+  {
+    std::vector<struct extent> extents;
+    ext_collect((const char *)ino->blocks, extents);
+    for (auto e : extents)
+    {
+      for (uint32_t i = 0; i < e.len; ++i)
+      {
+        blocks.push_back(e.pblk + i);
+      }
+    }
+    return;
+  }
+
+  uint64_t remain = ino->nblocks;
+  for (uint32_t i = 0; i < NDIRECT && remain > 0; ++i, --remain)
+  {
+    blocks.push_back(ino->blocks[i]);
+  }
+  for (uint32_t depth = 1; depth <= NLEVELS && remain > 0; ++depth)
+  {
+    read_blockid_tree(ino->blocks[NDIRECT + depth - 1], depth, remain, blocks);
+  }
+}
+
+void inode_manager::read_blockid_tree(blockid_t id, uint32_t depth, uint64_t &remain, std::vector<blockid_t> &blocks) const
+{
+  uint64_t span = bmap_span(depth);
+  if (id == 0)
+  {
+    // a hole, reads as zeros
+    uint64_t n = MIN(remain, span * NINDIRECT(bm->sb));
+    blocks.insert(blocks.end(), n, 0);
+    remain -= n;
+    return;
+  }
+  buf_ref b = bm->get_block(id);
+  const blockid_t *entries = (const blockid_t *)b.data();
+  for (uint32_t i = 0; i < NINDIRECT(bm->sb) && remain > 0; ++i)
+  {
+    if (depth == 1)
+    {
+      blocks.push_back(entries[i]);
+      --remain;
+    }
+    else
+    {
+      read_blockid_tree(entries[i], depth - 1, remain, blocks);
+    }
+  }
+}
+
+/* Get all the data of a file by inum.
+ * Return alloced data, should be freed by caller. */
+void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) const
+{
+  /*
+   * your code goes here.
+   * note: read blocks related to inode number inum,
+   * and copy them to buf_out
+   */
+  std::cout << "inode_manager: start read " << std::endl;
+  inode_ref ino = get_inode(inum);
+  if (!ino)
+  {
+    return;
+  }
+  std::shared_lock<std::shared_mutex> guard(ino.lock());
+
+  *size = ino->size;
+  *buf_out = (char *)malloc((*size) + 1);
+  (*buf_out)[*size] = '\0';
+  read_data(ino.get(), 0, *size, *buf_out);
+  std::cout << "inode_manager: size " << *size << std::endl;
+  return;
+}
+
+/* Read up to len bytes from off on into buf, stopping at the end of the
+ * file. Return the number of bytes read. Only the blocks covering the
+ * range are touched; the whole blocks are read with one read_blocks, so
+ * runs that sit together on disk go as single I/Os, all in flight at
+ * once. */
+int inode_manager::read_file(uint32_t inum, uint64_t off, uint32_t len, char *buf) const
+{
+  inode_ref ino = get_inode(inum);
+  if (!ino)
+  {
+    return 0;
+  }
+  std::shared_lock<std::shared_mutex> guard(ino.lock());
+  return read_data(ino.get(), off, len, buf);
+}
+
+// read_file on an inode the caller has locked.
+int inode_manager::read_data(const struct inode *ino, uint64_t off, uint32_t len, char *buf) const
+{
+  if (off >= ino->size)
+  {
+    return 0;
+  }
+
+  len = MIN((uint64_t)len, ino->size - off);
+  // the whole blocks lie together in buf, from whole on
+  std::vector<blockid_t> ids;
+  char *whole = NULL;
+  uint32_t done = 0;
+  while (done < len)
+  {
+    uint64_t pos = off + done;
+    uint32_t skip = pos % bs;
+    uint32_t run = 1;
+    blockid_t id = bmap(ino, pos / bs, &run);
+    uint32_t chunk = MIN((uint64_t)run * bs - skip, (uint64_t)(len - done));
+    if (skip == 0 && chunk >= bs)
+    {
+      chunk -= chunk % bs;
+      if (whole == NULL)
+      {
+        whole = buf + done;
+      }
+      for (uint32_t i = 0; i < chunk / bs; ++i)
+      {
+        ids.push_back(id == 0 ? 0 : id + i);
+      }
+    }
+    else if (id == 0)
+    {
+      // part of a hole
+      memset(buf + done, 0, chunk);
+    }
+    else
+    {
+      // head or tail of the range, part of a block
+      chunk = MIN(chunk, bs - skip);
+      buf_ref b = bm->get_block(id);
+      memcpy(buf + done, b.data() + skip, chunk);
+    }
+    done += chunk;
+  }
+  if (!ids.empty())
+  {
+    struct iovec iov = {whole, ids.size() * bs};
+    bm->read_blocks(ids.data(), ids.size(), &iov, 1);
+  }
+  return len;
+}
+
+/* Like the ranged read_file, but instead of copying the data return
+ * views of it in v: cached blocks stay pinned in the buffer cache, the
+ * rest are read straight from the disk image, and views that meet are
+ * merged. v keeps the file read locked until it goes away. Return the
+ * number of bytes covered. */
+int inode_manager::read_view(uint32_t inum, uint64_t off, uint32_t len, file_view &v) const
+{
+  static const char zeros[MAX_BLOCK_SIZE] = {0};
+  v.bytes = 0;
+  v.size = 0;
+  v.iov.clear();
+  v.pins.clear();
+  v.guard = std::shared_lock<std::shared_mutex>();
+  v.ino = get_inode(inum);
+  const inode_ref &ino = v.ino;
+  if (!ino)
+  {
+    return 0;
+  }
+  v.guard = std::shared_lock<std::shared_mutex>(ino.lock());
+  v.size = ino->size;
+  if (off >= ino->size)
+  {
+    return 0;
+  }
+
+  len = MIN((uint64_t)len, ino->size - off);
+  uint32_t done = 0;
+  while (done < len)
+  {
+    uint64_t pos = off + done;
+    uint32_t skip = pos % bs;
+    uint32_t chunk = MIN(bs - skip, len - done);
+    blockid_t id = bmap(ino.get(), pos / bs);
+    const char *p = zeros;
+    if (id != 0)
+    {
+      buf_ref b = bm->get_resident(id);
+      const char *data = b ? b.data() : bm->block_data(id);
+      if (data == NULL)
+      {
+        // on a log-structured disk, read it into the cache and pin it
+        b = bm->get_block(id);
+        data = b.data();
+      }
+      p = data + skip;
+      if (b)
+      {
+        v.pins.push_back(std::move(b));
+      }
+    }
+    if (!v.iov.empty() && id != 0 &&
+        (const char *)v.iov.back().iov_base + v.iov.back().iov_len == p)
+    {
+      v.iov.back().iov_len += chunk;
+    }
+    else
+    {
+      struct iovec iov = {(void *)p, chunk};
+      v.iov.push_back(iov);
+    }
+    done += chunk;
+  }
+  v.bytes = len;
+  return len;
+}
+
+// Bring the blocks holding [off, off + len) of inum into the buffer cache
+// for reads to come. The inode stays locked meanwhile, so no write can
+// slip in between reading a block and caching it.
+void inode_manager::prefetch(uint32_t inum, uint64_t off, uint32_t len) const
+{
+  inode_ref ino = get_inode(inum);
+  if (!ino)
+  {
+    return;
+  }
+  std::shared_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type != extent_protocol::T_FILE || off >= ino->size)
+  {
+    return;
+  }
+  uint64_t end = MIN(off + len, ino->size);
+  std::vector<blockid_t> ids;
+  for (uint64_t n = off / bs; n * bs < end;)
+  {
+    uint32_t run = 1;
+    blockid_t id = bmap(ino.get(), n, &run);
+    run = MIN((uint64_t)run, (end + bs - 1) / bs - n);
+    for (uint32_t i = 0; id != 0 && i < run; ++i)
+    {
+      ids.push_back(id + i);
+    }
+    n += run;
+  }
+  bm->prefetch(ids.data(), ids.size());
+}
+
+/* alloc/free blocks if needed. Return size, or -ENOSPC with the old
+ * contents left as they were if the disk is full. */
+int inode_manager::write_file(uint32_t inum, const char *buf, int size)
+{
+  /*
+   * your code goes here.
+   * note: write buf to blocks of inode inum.
+   * you need to consider the situation when the size of buf
+   * is larger or smaller than the size of original inode
+   */
+  inode_ref ino = get_inode(inum);
+  if (!ino || size < 0)
+  {
+    return 0;
+  }
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+
+  // Lay the data out over as few contiguous runs as the free space
+  // allows, writing each run in one go, before the old contents are
+  // dropped, so that running out of room leaves them be.
+  uint32_t nblocks = size / bs + (size % bs != 0);
+  std::vector<std::pair<blockid_t, uint32_t>> runs;
+  auto give_back = [&](size_t from) {
+    for (size_t r = from; r < runs.size(); ++r)
+    {
+      for (uint32_t i = 0; i < runs[r].second; ++i)
+      {
+        bm->free_block(runs[r].first + i);
+      }
+    }
+    return -ENOSPC;
+  };
+  std::vector<blockid_t> ids;
+  uint32_t done = 0;
+  while (done < nblocks)
+  {
+    uint32_t len = 0;
+    blockid_t start = bm->alloc_extent(nblocks - done, len);
+    if (start == 0)
+    {
+      return give_back(0);
+    }
+    runs.push_back(std::make_pair(start, len));
+    // a partial last block is padded with zeros
+    uint32_t full = (done + len == nblocks && size % bs != 0) ? len - 1 : len;
+    for (uint32_t i = 0; i < full; ++i)
+    {
+      ids.push_back(start + i);
+    }
+    if (full < len)
+    {
+      char temp[MAX_BLOCK_SIZE];
+      memset(temp, 0, bs);
+      memcpy(temp, buf + (size_t)(done + full) * bs, size % bs);
+      bm->write_block(start + full, temp);
+    }
+    done += len;
+  }
+  struct iovec iov = {(void *)buf, ids.size() * bs};
+  if (!ids.empty() && !bm->write_blocks(ids.data(), ids.size(), &iov, 1))
+  {
+    return give_back(0);
+  }
+
+  // Raw contents carry no directory index.
+  bmap_free(ino.get(), 0);
+  ino->flags &= ~INODE_HTREE;
+  done = 0;
+  for (size_t r = 0; r < runs.size(); ++r)
+  {
+    try
+    {
+      bmap_append(ino.get(), done, runs[r].first, runs[r].second);
+    }
+    catch (std::bad_alloc &)
+    {
+      // No room for an index block to map the run. The old contents
+      // are gone by now, so the file is left empty.
+      bmap_free(ino.get(), 0);
+      ino->nblocks = 0;
+      ino->size = 0;
+      put_inode(inum, ino.get());
+      return give_back(r);
+    }
+    done += runs[r].second;
+  }
+  ino->nblocks = nblocks;
+  ino->size = size;
+  ino->mtime = time(NULL);
+  put_inode(inum, ino.get());
+  return size;
+}
+
+// Most blocks ino can have: block counts are 32 bits, and a block tree
+// maps no more than MAXFILE.
+uint64_t inode_manager::max_blocks(const struct inode *ino) const
+{
+  uint64_t n = UINT32_MAX;
+  if (!(ino->flags & INODE_EXTENTS))
+  {
+    n = MIN(n, MAXFILE(bm->sb));
+  }
+  return n;
+}
+
+// The size file inum cannot grow past, 0 if there is no such file.
+uint64_t inode_manager::max_file_size(uint32_t inum) const
+{
+  inode_ref ino = get_inode(inum);
+  return ino ? max_blocks(ino.get()) * bs : 0;
+}
+
+/* Write len bytes of buf at off. Blocks already in the file are
+ * overwritten in place; only blocks past its end are allocated. A gap
+ * between the old end and off reads back as zeros. Return len, -EISDIR
+ * if inum is not a file or symlink, -EFBIG if the file cannot reach
+ * off + len, or -ENOSPC if the disk is full;
+ * the file keeps its size and blocks in both cases, though on a full
+ * log-structured disk some of the range may have been overwritten. */
+int inode_manager::write_file(uint32_t inum, uint64_t off, const char *buf, uint32_t len)
+{
+  inode_ref ino = get_inode(inum);
+  if (!ino || len == 0)
+  {
+    return 0;
+  }
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+
+  // directories are only written through their entries
+  if (ino->type != extent_protocol::T_FILE && ino->type != extent_protocol::T_LNK)
+  {
+    return -EISDIR;
+  }
+  if (off > max_blocks(ino.get()) * bs - len)
+  {
+    return -EFBIG;
+  }
+
+  uint64_t end = off + len;
+  uint32_t final_blocks = end / bs + (end % bs != 0);
+  // blocks [first_full, last_full) are wholly overwritten and need no zeroing
+  uint32_t first_full = off / bs + (off % bs != 0);
+  uint32_t last_full = MAX(end / bs, first_full);
+  uint32_t old_nblocks = ino->nblocks;
+  auto undo = [&]() {
+    // give back what this write took
+    bmap_free(ino.get(), old_nblocks);
+    ino->nblocks = old_nblocks;
+    put_inode(inum, ino.get());
+    return -ENOSPC;
+  };
+  while (ino->nblocks < final_blocks)
+  {
+    uint32_t n = ino->nblocks;
+    uint32_t run = 0;
+    blockid_t start = bm->alloc_extent(final_blocks - n, run);
+    if (start != 0)
+    {
+      try
+      {
+        bmap_append(ino.get(), n, start, run);
+      }
+      catch (std::bad_alloc &)
+      {
+        // no room for the index block to map the run
+        for (uint32_t i = 0; i < run; ++i)
+        {
+          bm->free_block(start + i);
+        }
+        start = 0;
+      }
+    }
+    if (start == 0)
+    {
+      return undo();
+    }
+    ino->nblocks += run;
+    if (n < first_full && !zero_blocks(start, MIN(first_full, n + run) - n))
+    {
+      return undo();
+    }
+    if (n + run > last_full)
+    {
+      uint32_t from = MAX(last_full, n);
+      if (!zero_blocks(start + (from - n), n + run - from))
+      {
+        return undo();
+      }
+    }
+  }
+
+  // as in read_data, the whole blocks lie together in buf
+  std::vector<blockid_t> ids;
+  const char *whole = NULL;
+  uint32_t done = 0;
+  while (done < len)
+  {
+    uint64_t pos = off + done;
+    uint32_t skip = pos % bs;
+    uint32_t run = 1;
+    blockid_t id = bmap(ino.get(), pos / bs, &run);
+    uint32_t chunk = MIN((uint64_t)run * bs - skip, (uint64_t)(len - done));
+    if (skip == 0 && chunk >= bs)
+    {
+      chunk -= chunk % bs;
+      if (whole == NULL)
+      {
+        whole = buf + done;
+      }
+      for (uint32_t i = 0; i < chunk / bs; ++i)
+      {
+        ids.push_back(id + i);
+      }
+    }
+    else
+    {
+      // head or tail of the range, part of a block
+      chunk = MIN(chunk, bs - skip);
+      buf_ref b = bm->get_block(id);
+      memcpy(b.data() + skip, buf + done, chunk);
+      b.mark_dirty();
+    }
+    done += chunk;
+  }
+  if (!ids.empty())
+  {
+    struct iovec iov = {(void *)whole, ids.size() * bs};
+    if (!bm->write_blocks(ids.data(), ids.size(), &iov, 1))
+    {
+      return undo();
+    }
+  }
+
+  if (end > ino->size)
+  {
+    ino->size = end;
+  }
+  ino->mtime = time(NULL);
+  put_inode(inum, ino.get());
+  return len;
+}
+
+// Zero len blocks from start on, straight to the disk. Return false if
+// the disk had no room for them.
+bool inode_manager::zero_blocks(blockid_t start, uint32_t len)
+{
+  static const char zeros[16 * MAX_BLOCK_SIZE] = {0};
+  uint32_t chunk = sizeof(zeros) / bs;
+  for (uint32_t i = 0; i < len; i += chunk)
+  {
+    if (!bm->write_range(start + i, MIN(chunk, len - i), zeros))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a) const
+{
+  /*
+   * your code goes here.
+   * note: get the attributes of inode inum.
+   * you can refer to "struct attr" in extent_protocol.h
+   */
+  inode_ref ino = get_inode(inum);
+  if (!ino)
+  {
+    return;
+  }
+  std::shared_lock<std::shared_mutex> guard(ino.lock());
+  a.atime = ino->atime;
+  a.mtime = ino->mtime;
+  a.ctime = ino->ctime;
+  a.size = ino->size;
+  a.type = ino->type;
+  return;
+}
+
+void inode_manager::remove_file(uint32_t inum)
+{
+  /*
+   * your code goes here
+   * note: you need to consider about both the data block and inode of the file
+   */
+  inode_ref ino = get_inode(inum);
+  if (!ino)
+  {
+    return;
+  }
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type == 0)
+  {
+    return;
+  }
+
+  bmap_free(ino.get(), 0);
+  free_inode(inum);
+  return;
+}
+
+void inode_manager::read_dir(uint32_t inum, std::vector<std::pair<extent_protocol::extentid_t, std::string>> &bufs) const
+{
+  inode_ref ino = get_inode(inum);
+  if (!ino)
+  {
+    return;
+  }
+  std::shared_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type != extent_protocol::T_DIR)
+  {
+    return;
+  }
+
+  // the whole directory is read in one go rather than a block at a time
+  // through the cache
+  std::vector<blockid_t> block_ids;
+  read_blockid(inum, block_ids);
+  std::vector<char> data((size_t)block_ids.size() * bs);
+  struct iovec iov = {data.data(), data.size()};
+  bm->read_blocks(block_ids.data(), block_ids.size(), &iov, 1);
+  for (size_t i = 0; i < block_ids.size(); ++i)
+  {
+    const char *block = data.data() + i * bs;
+    for (uint32_t off = 0; off < bs; )
+    {
+      const struct dir_entry *e = (const struct dir_entry *)(block + off);
+      if (e->rec_len == 0)
+      {
+        break;
+      }
+      if (e->inum != 0)
+      {
+        bufs.push_back({(extent_protocol::extentid_t)e->inum, std::string((const char *)(e + 1), e->name_len)});
+      }
+      off += e->rec_len;
+    }
+  }
+  return;
+}
+
+// Hash of an entry name for the directory index: FNV-1a with a final
+// mix. The low bit is left clear for continuation keys.
+static uint32_t dx_hash(const char *name, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i)
+  {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h & ~1u;
+}
+
+// The live entry called name in one entry block, or NULL. prev, if set,
+// gets the entry before it in the block, NULL for the first.
+static struct dir_entry *dirent_find(char *data, uint32_t bs, const std::string &name,
+                                     struct dir_entry **prev)
+{
+  struct dir_entry *p = NULL;
+  for (uint32_t off = 0; off < bs; )
+  {
+    struct dir_entry *e = (struct dir_entry *)(data + off);
+    if (e->rec_len == 0)
+    {
+      break;
+    }
+    if (e->inum != 0 && e->name_len == name.length() &&
+        memcmp(e + 1, name.data(), name.length()) == 0)
+    {
+      if (prev != NULL)
+      {
+        *prev = p;
+      }
+      return e;
+    }
+    p = e;
+    off += e->rec_len;
+  }
+  return NULL;
+}
+
+// Drop entry e from its block. Its space goes to the entry before it, or
+// if it is the first, the entry is just marked free; either way a later
+// add_to_dir can reuse it.
+static void dirent_remove(struct dir_entry *e, struct dir_entry *prev)
+{
+  if (prev != NULL)
+  {
+    prev->rec_len += e->rec_len;
+  }
+  else
+  {
+    e->inum = 0;
+  }
+}
+
+// The first gap of need bytes in one entry block, be it a free entry or
+// the slack behind a live one, which is split off. NULL if there is none.
+static struct dir_entry *dirent_slot(char *data, uint32_t bs, uint32_t need)
+{
+  for (uint32_t off = 0; off < bs; )
+  {
+    struct dir_entry *cur = (struct dir_entry *)(data + off);
+    if (cur->rec_len == 0)
+    {
+      break;
+    }
+    uint32_t used = cur->inum ? DIRENT_SIZE(cur->name_len) : 0;
+    if (cur->rec_len - used >= need)
+    {
+      if (used == 0)
+      {
+        return cur;
+      }
+      struct dir_entry *e = (struct dir_entry *)(data + off + used);
+      e->rec_len = cur->rec_len - used;
+      cur->rec_len = used;
+      return e;
+    }
+    off += cur->rec_len;
+  }
+  return NULL;
 }
 
-/* alloc/free blocks if needed */
-void inode_manager::write_file(uint32_t inum, const char *buf, int size)
+static void dirent_fill(struct dir_entry *e, uint32_t inum, const std::string &name, uint8_t type)
 {
-  /*
-   * your code goes here.
-   * note: write buf to blocks of inode inum.
-   * you need to consider the situation when the size of buf
-   * is larger or smaller than the size of original inode
-   */
-  if (size < 0)
+  e->inum = inum;
+  e->name_len = name.length();
+  e->type = type;
+  memcpy(e + 1, name.data(), name.length());
+}
+
+typedef struct dx_item
+{
+  uint32_t hash;
+  uint32_t inum;
+  uint8_t type;
+  std::string name;
+} dx_item_t;
+
+// Rewrite an entry block to hold items[from, to) back to back.
+static void dirent_pack(char *data, uint32_t bs, const std::vector<dx_item> &items, size_t from, size_t to)
+{
+  memset(data, 0, bs);
+  uint32_t off = 0;
+  struct dir_entry *e = NULL;
+  for (size_t i = from; i < to; ++i)
   {
-    return;
+    e = (struct dir_entry *)(data + off);
+    dirent_fill(e, items[i].inum, items[i].name, items[i].type);
+    e->rec_len = DIRENT_SIZE(items[i].name.length());
+    off += e->rec_len;
   }
+  e->rec_len += bs - off;
+}
 
-  struct inode *ino = get_inode(inum);
-  if (ino == NULL)
+// Grow a directory by an empty entry block. Return its logical number.
+uint32_t inode_manager::dir_append_block(struct inode *ino)
+{
+  blockid_t id = bm->alloc_block();
+  if (id == 0)
   {
-    return;
+    throw std::bad_alloc();
   }
+  buf_ref b = bm->get_block(id);
+  memset(b.data(), 0, bs);
+  ((struct dir_entry *)b.data())->rec_len = bs;
+  b.mark_dirty();
+  uint32_t lblk = ino->nblocks;
+  bmap_append(ino, lblk, id, 1);
+  ino->nblocks += 1;
+  ino->size += bs;
+  return lblk;
+}
+
+// Index a full one-block directory: its entries move to a new block,
+// which becomes the only leaf of a root built in block 0.
+void inode_manager::dx_convert(struct inode *ino)
+{
+  uint32_t leaf = dir_append_block(ino);
+  buf_ref root = bm->get_block(bmap(ino, 0));
+  buf_ref b = bm->get_block(bmap(ino, leaf));
+  memcpy(b.data(), root.data(), bs);
+  b.mark_dirty();
+
+  memset(root.data(), 0, bs);
+  struct dx_node *n = (struct dx_node *)root.data();
+  struct dx_entry *ents = (struct dx_entry *)(n + 1);
+  n->fake.rec_len = bs;
+  n->count = 1;
+  n->levels = 0;
+  ents[0].hash = 0;
+  ents[0].block = leaf;
+  root.mark_dirty();
+  ino->flags |= INODE_HTREE;
+}
 
-  for (int i = 0; i < MIN(size / BLOCK_SIZE + (size % BLOCK_SIZE != 0), NDIRECT); ++i)
+// Walk the index down to the leaf whose range holds hash, taking in each
+// node the last key not above it.
+void inode_manager::dx_find(const struct inode *ino, uint32_t hash, std::vector<dx_frame> &path) const
+{
+  path.clear();
+  uint32_t lblk = 0;
+  for (;;)
   {
-    blockid_t id = bm->alloc_block();
-    if (id > 0)
+    buf_ref b = bm->get_block(bmap(ino, lblk));
+    const struct dx_node *n = (const struct dx_node *)b.data();
+    const struct dx_entry *ents = (const struct dx_entry *)(n + 1);
+    uint32_t lo = 1, hi = n->count;
+    while (lo < hi)
     {
-      if (BLOCK_SIZE * (i + 1) > size)
+      uint32_t mid = (lo + hi) / 2;
+      if (ents[mid].hash <= hash)
       {
-        char temp[BLOCK_SIZE];
-        memset(temp, 0, BLOCK_SIZE);
-        memcpy(temp, buf + BLOCK_SIZE * i, size - BLOCK_SIZE * i);
-        bm->write_block(id, temp);
+        lo = mid + 1;
       }
       else
       {
-        bm->write_block(id, buf + BLOCK_SIZE * i);
+        hi = mid;
       }
-      ino->blocks[i] = id;
     }
-    else
+    dx_frame f = {lblk, lo - 1};
+    path.push_back(f);
+    if (n->levels == 0)
     {
-      throw std::bad_alloc();
+      return;
     }
+    lblk = ents[lo - 1].block;
   }
-  if (size > NDIRECT * BLOCK_SIZE)
+}
+
+// Step path on to the next leaf if that leaf continues the run of
+// entries hashing to hash. Otherwise leave path alone and return false.
+bool inode_manager::dx_next(const struct inode *ino, std::vector<dx_frame> &path, uint32_t hash) const
+{
+  std::vector<dx_frame> next = path;
+  int i = (int)next.size() - 1;
+  for (; i >= 0; --i)
   {
-    blockid_t id = bm->alloc_block();
-    if (id == 0)
+    buf_ref b = bm->get_block(bmap(ino, next[i].lblk));
+    if (next[i].pos + 1 < ((const struct dx_node *)b.data())->count)
     {
-      throw std::bad_alloc();
+      next[i].pos++;
+      break;
     }
-
-    uint32_t inodes[BLOCK_SIZE / sizeof(uint32_t)] = {0};
-    uint32_t i = 0;
-    do
-    {
-      uint32_t inode_num = alloc_inode(extent_protocol::T_FILE);
-      inodes[i] = inode_num;
-      write_file(inode_num, 
-        buf + NDIRECT * BLOCK_SIZE * (i + 1), 
-        MIN(size - NDIRECT * BLOCK_SIZE * (i + 1), NDIRECT * BLOCK_SIZE));
-      ++i;
-    } while((uint32_t)size > NDIRECT * BLOCK_SIZE * (i + 1) && i < BLOCK_SIZE / sizeof(uint32_t) - 1);
-    if (i == BLOCK_SIZE / sizeof(uint32_t) - 1)
+  }
+  if (i < 0)
+  {
+    return false;
+  }
+  uint32_t key = 0;
+  for (uint32_t j = i; j < next.size(); ++j)
+  {
+    buf_ref b = bm->get_block(bmap(ino, next[j].lblk));
+    const struct dx_entry *ents = (const struct dx_entry *)((const struct dx_node *)b.data() + 1);
+    key = ents[next[j].pos].hash;
+    if (j + 1 < next.size())
     {
-      uint32_t inode_num = alloc_inode(extent_protocol::T_FILE);
-      inodes[i] = inode_num;
-      write_file(inode_num,
-        buf + NDIRECT * BLOCK_SIZE * (i + 1),
-        size - NDIRECT * BLOCK_SIZE * (i + 1));
+      next[j + 1].lblk = ents[next[j].pos].block;
+      next[j + 1].pos = 0;
     }
-    bm->write_block(id, (char *)inodes);
-    ino->blocks[NDIRECT] = id;
   }
-  ino->size = MIN(size / BLOCK_SIZE + (size % BLOCK_SIZE != 0), NDIRECT + 1);
-  ino->mtime = time(NULL);
-  put_inode(inum, ino);
-  free(ino);
-  return;
+  if (key != (hash | 1))
+  {
+    return false;
+  }
+  path = next;
+  return true;
 }
 
-void inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a) const
+uint32_t inode_manager::dx_leaf(const struct inode *ino, const std::vector<dx_frame> &path) const
 {
-  /*
-   * your code goes here.
-   * note: get the attributes of inode inum.
-   * you can refer to "struct attr" in extent_protocol.h
-   */
-  struct inode *ino = get_inode(inum);
-  a.atime = ino->atime;
-  a.mtime = ino->mtime;
-  a.ctime = ino->ctime;
-  a.size = get_file_size(inum);
-  a.type = ino->type;
-  free(ino);
-  return;
+  buf_ref b = bm->get_block(bmap(ino, path.back().lblk));
+  const struct dx_entry *ents = (const struct dx_entry *)((const struct dx_node *)b.data() + 1);
+  return ents[path.back().pos].block;
 }
 
-void inode_manager::remove_file(uint32_t inum)
+// Insert key (hash, lblk) into the index node at path[level], just after
+// path[level].pos. A full node is split in half and the new half goes
+// into its parent the same way; a full root first moves its entries down
+// into a new node, making the tree one level deeper.
+void inode_manager::dx_insert(struct inode *ino, std::vector<dx_frame> &path, uint32_t level,
+                              uint32_t hash, uint32_t lblk)
 {
-  /*
-   * your code goes here
-   * note: you need to consider about both the data block and inode of the file
-   */
-  struct inode *ino = get_inode(inum);
-  if (ino->type == 0)
+  uint32_t pos = path[level].pos + 1;
+  {
+    buf_ref b = bm->get_block(bmap(ino, path[level].lblk));
+    struct dx_node *n = (struct dx_node *)b.data();
+    struct dx_entry *ents = (struct dx_entry *)(n + 1);
+    if (n->count < DX_MAX(bs))
+    {
+      memmove(ents + pos + 1, ents + pos, (n->count - pos) * sizeof(struct dx_entry));
+      ents[pos].hash = hash;
+      ents[pos].block = lblk;
+      n->count++;
+      b.mark_dirty();
+      return;
+    }
+  }
+
+  if (level == 0)
   {
-    free(ino);
+    uint32_t child = dir_append_block(ino);
+    buf_ref root = bm->get_block(bmap(ino, 0));
+    buf_ref c = bm->get_block(bmap(ino, child));
+    memcpy(c.data(), root.data(), bs);
+    c.mark_dirty();
+    struct dx_node *n = (struct dx_node *)root.data();
+    struct dx_entry *ents = (struct dx_entry *)(n + 1);
+    n->count = 1;
+    n->levels++;
+    ents[0].hash = 0;
+    ents[0].block = child;
+    root.mark_dirty();
+    dx_frame f = {child, path[0].pos};
+    path[0].pos = 0;
+    path.insert(path.begin() + 1, f);
+    dx_insert(ino, path, 1, hash, lblk);
     return;
   }
 
-  for (uint32_t i = 0; i < NDIRECT; ++i)
+  uint32_t right = dir_append_block(ino);
+  uint32_t key;
   {
-    if (ino->blocks[i] == 0)
+    buf_ref b = bm->get_block(bmap(ino, path[level].lblk));
+    buf_ref r = bm->get_block(bmap(ino, right));
+    struct dx_node *n = (struct dx_node *)b.data();
+    struct dx_node *rn = (struct dx_node *)r.data();
+    struct dx_entry *ents = (struct dx_entry *)(n + 1);
+    struct dx_entry *rents = (struct dx_entry *)(rn + 1);
+    uint32_t half = n->count / 2;
+    memset(r.data(), 0, bs);
+    rn->fake.rec_len = bs;
+    rn->levels = n->levels;
+    rn->count = n->count - half;
+    memcpy(rents, ents + half, rn->count * sizeof(struct dx_entry));
+    n->count = half;
+
+    struct dx_node *dst = n;
+    if (pos >= half)
     {
-      break;
+      dst = rn;
+      pos -= half;
     }
-    bm->free_block(ino->blocks[i]);
+    struct dx_entry *dents = (struct dx_entry *)(dst + 1);
+    memmove(dents + pos + 1, dents + pos, (dst->count - pos) * sizeof(struct dx_entry));
+    dents[pos].hash = hash;
+    dents[pos].block = lblk;
+    dst->count++;
+    key = rents[0].hash;
+    b.mark_dirty();
+    r.mark_dirty();
   }
-  if (ino->size > NDIRECT)
+  dx_insert(ino, path, level - 1, key, right);
+}
+
+// Split the full leaf at the end of path to make room for a new entry.
+// The leaf's entries and the new one are sorted by hash and cut, if
+// possible, once between two different hashes into halves that each fit
+// a block. Failing that, they are cut wherever a block fills up, and a
+// cut inside a run of equal hashes gets a continuation key.
+void inode_manager::dx_split_leaf(struct inode *ino, const std::vector<dx_frame> &path, uint32_t inum,
+                                  const std::string &name, uint8_t type)
+{
+  uint32_t leaf = dx_leaf(ino, path);
+  std::vector<dx_item> items;
   {
-    uint32_t inodes[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inodes);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    buf_ref b = bm->get_block(bmap(ino, leaf));
+    for (uint32_t off = 0; off < bs; )
     {
-      if (inodes[i] == 0)
+      const struct dir_entry *e = (const struct dir_entry *)(b.data() + off);
+      if (e->rec_len == 0)
       {
         break;
       }
-      remove_file(inodes[i]);
+      if (e->inum != 0)
+      {
+        std::string n((const char *)(e + 1), e->name_len);
+        items.push_back({dx_hash(n.data(), n.length()), e->inum, e->type, n});
+      }
+      off += e->rec_len;
     }
   }
-  free_inode(inum);
-  free(ino);
-  return;
-}
+  items.push_back({dx_hash(name.data(), name.length()), inum, type, name});
+  std::stable_sort(items.begin(), items.end(),
+                   [](const dx_item &x, const dx_item &y) { return x.hash < y.hash; });
 
-void inode_manager::read_dir(uint32_t inum, std::vector<std::pair<extent_protocol::extentid_t, std::string>> &bufs) const
-{
-  struct inode *ino = get_inode(inum);
-  if (ino == NULL || ino->type != extent_protocol::T_DIR)
+  std::vector<size_t> prefix(items.size() + 1, 0);
+  for (size_t i = 0; i < items.size(); ++i)
   {
-    return;
+    prefix[i + 1] = prefix[i] + DIRENT_SIZE(items[i].name.length());
   }
-
-  std::vector<std::pair<extent_protocol::extentid_t, std::string>> direct_bufs;
-  direct_bufs.reserve(MIN(ino->size, NDIRECT));
-  for (uint32_t i = 0; i < MIN(ino->size, NDIRECT); ++i)
+  size_t total = prefix[items.size()];
+  size_t best = 0, best_max = (size_t)-1;
+  for (size_t i = 1; i < items.size(); ++i)
   {
-    char buf[BLOCK_SIZE + 1];
-    uint32_t dir_inum = 0;
-    bm->read_block(ino->blocks[i], buf);
-    
-    buf[BLOCK_SIZE] = '\0';
-    memcpy(&dir_inum, buf, sizeof(uint32_t));
-    std::string str(buf + sizeof(uint32_t));
-    direct_bufs.push_back({(extent_protocol::extentid_t)dir_inum, str});
+    size_t m = MAX(prefix[i], total - prefix[i]);
+    if (items[i - 1].hash != items[i].hash && m < best_max)
+    {
+      best = i;
+      best_max = m;
+    }
+  }
+  std::vector<size_t> cuts;
+  if (best > 0 && best_max <= bs)
+  {
+    cuts.push_back(best);
   }
-  std::vector<std::pair<extent_protocol::extentid_t, std::string>> indirect_bufs;
-  if (ino->size > NDIRECT)
+  else
   {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    size_t used = 0;
+    for (size_t i = 0; i < items.size(); ++i)
     {
-      if (inum_buf[i] == 0)
+      size_t sz = DIRENT_SIZE(items[i].name.length());
+      if (used + sz > bs)
       {
-        break;
+        cuts.push_back(i);
+        used = 0;
       }
-      std::vector<std::pair<extent_protocol::extentid_t, std::string>> temp_buf;
-      read_dir(inum_buf[i], temp_buf);
-      indirect_bufs.insert(indirect_bufs.end(), temp_buf.begin(), temp_buf.end());
+      used += sz;
     }
   }
-  bufs.insert(bufs.end(), direct_bufs.begin(), direct_bufs.end());
-  bufs.insert(bufs.end(), indirect_bufs.begin(), indirect_bufs.end());
-  free(ino);
-  return;
+  cuts.push_back(items.size());
+
+  {
+    buf_ref b = bm->get_block(bmap(ino, leaf));
+    dirent_pack(b.data(), bs, items, 0, cuts[0]);
+    b.mark_dirty();
+  }
+  for (size_t c = 0; c + 1 < cuts.size(); ++c)
+  {
+    size_t from = cuts[c];
+    uint32_t key = items[from].hash;
+    if (items[from - 1].hash == key)
+    {
+      key |= 1;
+    }
+    uint32_t lblk = dir_append_block(ino);
+    {
+      buf_ref b = bm->get_block(bmap(ino, lblk));
+      dirent_pack(b.data(), bs, items, from, cuts[c + 1]);
+      b.mark_dirty();
+    }
+    std::vector<dx_frame> p;
+    dx_find(ino, key, p);
+    dx_insert(ino, p, p.size() - 1, key, lblk);
+  }
 }
 
+// Add an entry for inum. A directory of one block takes it in the first
+// gap big enough; once that block is full the directory is indexed, and
+// the entry goes in the leaf its name hashes to, which is split if full.
 void inode_manager::add_to_dir(uint32_t parent_inum, uint32_t inum, std::string name)
 {
-  struct inode *ino = get_inode(parent_inum);
-  if (ino == NULL || ino->type != extent_protocol::T_DIR)
+  inode_ref ino = get_inode(parent_inum);
+  if (!ino)
   {
     return;
   }
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type != extent_protocol::T_DIR)
+  {
+    return;
+  }
+  dir_add(parent_inum, ino.get(), inum, name);
+}
 
-  if (ino->size < NDIRECT)
+// add_to_dir on a directory the caller has locked. Return false if the
+// name cannot be stored.
+bool inode_manager::dir_add(uint32_t parent_inum, struct inode *ino, uint32_t inum, const std::string &name)
+{
+  if (name.empty() || name.length() > DIR_NAME_MAX)
   {
-    blockid_t id = bm->alloc_block();
-    if (id == 0)
+    printf("\tim: bad directory entry name length %lu\n", name.length());
+    return false;
+  }
+
+  inode_ref child = get_inode(inum);
+  uint8_t type = child ? child->type : 0;
+  uint32_t need = DIRENT_SIZE(name.length());
+  bool done = false;
+  if (!(ino->flags & INODE_HTREE))
+  {
+    // unindexed directories from older images are searched whole
+    for (uint32_t i = 0; i < ino->nblocks && !done; ++i)
     {
-      throw std::bad_alloc();
+      buf_ref b = bm->get_block(bmap(ino, i));
+      struct dir_entry *e = dirent_slot(b.data(), bs, need);
+      if (e != NULL)
+      {
+        dirent_fill(e, inum, name, type);
+        b.mark_dirty();
+        done = true;
+      }
+    }
+    if (!done && ino->nblocks != 1)
+    {
+      buf_ref b = bm->get_block(bmap(ino, dir_append_block(ino)));
+      dirent_fill((struct dir_entry *)b.data(), inum, name, type);
+      b.mark_dirty();
+      done = true;
+    }
+    if (!done)
+    {
+      dx_convert(ino);
     }
-    char buf[BLOCK_SIZE] = {0};
-    memcpy(buf, &inum, sizeof(uint32_t));
-    memcpy(buf + sizeof(uint32_t), name.c_str(), name.length());
-    bm->write_block(id, buf);
-    ino->blocks[ino->size] = id;
   }
-  else
+  if (!done)
   {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    uint32_t hash = dx_hash(name.data(), name.length());
+    std::vector<dx_frame> path;
+    dx_find(ino, hash, path);
+    for (;;)
     {
-      if (inum_buf[i] == 0)
+      buf_ref b = bm->get_block(bmap(ino, dx_leaf(ino, path)));
+      struct dir_entry *e = dirent_slot(b.data(), bs, need);
+      if (e != NULL)
       {
-        inum_buf[i] = alloc_inode(extent_protocol::T_DIR);
-        add_to_dir(inum_buf[i], inum, name);
-        bm->write_block(ino->blocks[NDIRECT], (char *)inum_buf);
+        dirent_fill(e, inum, name, type);
+        b.mark_dirty();
         break;
       }
-      if (get_ino_block_num(inum_buf[i]) < NDIRECT || i == BLOCK_SIZE / sizeof(uint32_t) - 1)
+      if (!dx_next(ino, path, hash))
       {
-        add_to_dir(inum_buf[i], inum, name);
+        b.release();
+        dx_split_leaf(ino, path, inum, name, type);
         break;
       }
     }
   }
-  ino->size = (ino->size < NDIRECT + 1) ? ino->size + 1 : ino->size;
-  ino->mtime = time(NULL);
-  ino->ctime = time(NULL);
-  put_inode(parent_inum, ino);
-  free(ino);
-  return;
-}
-
-void inode_manager::remove_from_dir(uint32_t parent_inum, uint32_t inum)
-{
-  uint32_t index = 0;
-  blockid_t last_block_id = 0;
-  uint32_t last_block_index = 0;
-  free_and_find_last(parent_inum, inum, index, last_block_id, last_block_index);
-  set_ino_block_id(parent_inum, index, last_block_id);
-  set_ino_block_id(parent_inum, last_block_index, 0);
-  std::cout << "inode_manager : remove from dir index " << index << std::endl;
-  std::cout << "inode_manager : remove from dir last_block_id " << last_block_id << std::endl;
-  std::cout << "inode_manager : remove from dir last_block_index " << last_block_index << std::endl;
-
-  struct inode *ino = get_inode(parent_inum);
-  if (ino == NULL)
-  {
-    return;
-  }
 
   ino->mtime = time(NULL);
   ino->ctime = time(NULL);
   put_inode(parent_inum, ino);
-  free(ino);
-}
-
-uint32_t inode_manager::get_ino_block_num(uint32_t inum) const
-{
-  struct inode *ino = get_inode(inum);
-  uint32_t size = ino->size;
-  free(ino);
-  return size;
+  return true;
 }
 
-void inode_manager::set_attr(uint32_t inum, size_t size)
+// Create an inode of type and enter it in parent_inum as name, holding
+// the directory's lock throughout so the name cannot be taken in between.
+// Return true with inum set to the new inode, or false with inum set to
+// the inode the name already has, 0 if it cannot be added at all.
+bool inode_manager::create_in(uint32_t parent_inum, const std::string &name, uint32_t type, uint32_t &inum)
 {
-  uint32_t attr_size = get_file_size(inum);
-  if (attr_size < size)
+  inum = 0;
+  inode_ref ino = get_inode(parent_inum);
+  if (!ino)
   {
-    truncate_file(inum, size);
-  }
-  else if (attr_size > size)
-  {
-    padding_file(inum, size);
+    return false;
   }
-}
-
-uint32_t inode_manager::get_file_block_num(uint32_t inum) const
-{
-  uint32_t attr_size = 0;
-  struct inode *ino = get_inode(inum);
-  uint32_t size = ino->size;
-  if (size < NDIRECT + 1)
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type != extent_protocol::T_DIR || name.empty() || name.length() > DIR_NAME_MAX)
   {
-    attr_size += size;
+    return false;
   }
-  else
+  buf_ref b;
+  struct dir_entry *e = dir_search(ino.get(), name, b, NULL);
+  if (e != NULL)
   {
-    attr_size += NDIRECT;
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
-    {
-      if (inum_buf[i] == 0)
-      {
-        break;
-      }
-      attr_size += get_file_block_num(inum_buf[i]);
-    }
+    inum = e->inum;
+    return false;
   }
-  free(ino);
-  return attr_size;
+  b.release();
+  inum = alloc_inode(type);
+  dir_add(parent_inum, ino.get(), inum, name);
+  return true;
 }
 
-uint32_t inode_manager::get_file_size(uint32_t inum) const
+// Find the entry called name in a directory, leaving its block pinned in
+// b. In an indexed directory only the index path and the leaf the name
+// hashes to are read, plus any leaves continuing its run of equal hashes.
+struct dir_entry *
+inode_manager::dir_search(const struct inode *ino, const std::string &name, buf_ref &b,
+                          struct dir_entry **prev) const
 {
-  uint32_t attr_size = 0;
-  struct inode *ino = get_inode(inum);
-  uint32_t size = ino->size;
-  if (size == 0)
-  {
-    attr_size = 0;
-  }
-  else if (size < NDIRECT + 1)
-  {
-    attr_size = (size - 1) * BLOCK_SIZE + last_non_zero_element_index_in_block(ino->blocks[size - 1]) + 1;
-  }
-  else
+  if (!(ino->flags & INODE_HTREE))
   {
-    attr_size += NDIRECT * BLOCK_SIZE;
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    for (uint32_t i = 0; i < ino->nblocks; ++i)
     {
-      if (inum_buf[i] == 0)
+      b = bm->get_block(bmap(ino, i));
+      struct dir_entry *e = dirent_find(b.data(), bs, name, prev);
+      if (e != NULL)
       {
-        break;
+        return e;
       }
-      attr_size += get_file_size(inum_buf[i]);
     }
+    b.release();
+    return NULL;
   }
-  free(ino);
-  return attr_size;
-}
 
-int32_t inode_manager::last_non_zero_element_index_in_block(blockid_t id) const
-{
-  char block[BLOCK_SIZE] = {0};
-  bm->read_block(id, block);
-  for (int32_t i = BLOCK_SIZE - 1; i >= 0; --i)
+  uint32_t hash = dx_hash(name.data(), name.length());
+  std::vector<dx_frame> path;
+  dx_find(ino, hash, path);
+  do
   {
-    if (block[i] != 0)
+    b = bm->get_block(bmap(ino, dx_leaf(ino, path)));
+    struct dir_entry *e = dirent_find(b.data(), bs, name, prev);
+    if (e != NULL)
     {
-      return i;
+      return e;
     }
-  }
-  return 0;
+  } while (dx_next(ino, path, hash));
+  b.release();
+  return NULL;
 }
 
-void inode_manager::truncate_file(uint32_t inum, size_t size)
+// Return the inum of the entry called name in parent_inum, or 0.
+uint32_t inode_manager::lookup(uint32_t parent_inum, const std::string &name) const
 {
-  struct inode* ino = get_inode(inum);
-  uint32_t remain_blocks = size / BLOCK_SIZE + (size % BLOCK_SIZE != 0);
-  char zeros[BLOCK_SIZE] = {0};
-  for (uint32_t i = 0; i < MIN(ino->size, NDIRECT); ++i)
+  inode_ref ino = get_inode(parent_inum);
+  if (!ino)
   {
-    if (i >= remain_blocks)
-    {
-      bm->write_block(ino->blocks[i], zeros);
-      bm->free_block(ino->blocks[i]);
-    }
-  }
-  
-  if (ino->size > NDIRECT)
-  {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
-    {
-      if (inum_buf[i] == 0)
-      {
-        break;
-      }
-      uint32_t adj_size = (size > (i + 1) * BLOCK_SIZE * NDIRECT) ? size - (i + 1) * BLOCK_SIZE * NDIRECT : 0;
-      truncate_file(inum_buf[i], adj_size);
-    }
-  }
-  if (size == 0)
-  {
-    free_inode(inum);
+    return 0;
   }
-  else
+  std::shared_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type != extent_protocol::T_DIR)
   {
-    ino->size = MIN(remain_blocks, NDIRECT + 1);
-    ino->mtime = time(NULL);
-    put_inode(inum, ino);
+    return 0;
   }
-  free(ino);
+  buf_ref b;
+  struct dir_entry *e = dir_search(ino.get(), name, b, NULL);
+  return e != NULL ? e->inum : 0;
 }
 
-void inode_manager::padding_file(uint32_t inum, size_t size)
+// Whether a directory holds no entries. The caller holds its lock.
+bool inode_manager::dir_empty(const struct inode *ino) const
 {
-  struct inode* ino = get_inode(inum);
-  uint32_t final_blocks = size / BLOCK_SIZE + (size % BLOCK_SIZE != 0);
-  char zeros[BLOCK_SIZE] = {0};
-  for (uint32_t i = 0; i < MIN(final_blocks, NDIRECT); ++i)
-  {
-    if (i >= ino->size)
-    {
-      ino->blocks[i] = bm->alloc_block();
-      bm->write_block(ino->blocks[i], zeros);
-    }
-  }
-  if (final_blocks > NDIRECT)
+  for (uint32_t i = 0; i < ino->nblocks; ++i)
   {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    buf_ref b = bm->get_block(bmap(ino, i));
+    for (uint32_t off = 0; off < bs; )
     {
-      if (final_blocks <= (i + 1) * NDIRECT)
+      const struct dir_entry *e = (const struct dir_entry *)(b.data() + off);
+      if (e->rec_len == 0)
       {
         break;
       }
-      if (inum_buf[i] == 0)
+      if (e->inum != 0)
       {
-        inum_buf[i] = alloc_inode(ino->type);
+        return false;
       }
-      uint32_t adj_size = ((final_blocks > (i + 2) * NDIRECT) ? NDIRECT : final_blocks - (i + 1) * NDIRECT) * BLOCK_SIZE;
-      padding_file(inum_buf[i], adj_size);
+      off += e->rec_len;
     }
   }
-  
-  ino->size = MIN(final_blocks, NDIRECT + 1);
-  ino->mtime = time(NULL);
-  put_inode(inum, ino);
-  free(ino);
+  return true;
 }
 
-void inode_manager::ino_next_block(uint32_t inum, uint32_t iter, blockid_t &id) const
+// Remove the entry called name from parent_inum, setting inum to the
+// inode it named; the inode itself is left alone. The name is resolved
+// and removed under the directory's lock, so inum is the inode that was
+// unlinked. Return 0, -ENOENT if there is no such entry or -ENOTEMPTY
+// if it names a directory that is not empty.
+//
+// A file of more than max_size bytes is too big to free in the same
+// transaction. It is shrunk by max_size instead, still linked so that a
+// crash leaves no orphan, and -EAGAIN returned for the caller to call
+// again in a new transaction.
+int inode_manager::unlink(uint32_t parent_inum, const std::string &name, uint32_t &inum,
+                          uint64_t max_size)
 {
-  struct inode* ino = get_inode(inum);
-  if (ino == NULL)
+  inum = 0;
+  inode_ref ino = get_inode(parent_inum);
+  if (!ino)
   {
-    return;
+    return -ENOENT;
   }
-
-  if (iter < NDIRECT)
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type != extent_protocol::T_DIR)
   {
-    id = ino->blocks[iter];
-    free(ino);
-    return;
+    return -ENOENT;
   }
-  else
+  buf_ref b;
+  struct dir_entry *prev = NULL;
+  struct dir_entry *e = dir_search(ino.get(), name, b, &prev);
+  if (e == NULL)
   {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    uint32_t calc_index = (iter - NDIRECT) / NDIRECT;
-    uint32_t max_index = BLOCK_SIZE / sizeof(uint32_t) - 1;
-    uint32_t inum_buf_index = (calc_index < max_index) ? calc_index : max_index;
-
-    ino_next_block(inum_buf[inum_buf_index], iter - (inum_buf_index + 1) * NDIRECT, id);
+    return -ENOENT;
+  }
+  inode_ref child = get_inode(e->inum);
+  if (child)
+  {
+    std::unique_lock<std::shared_mutex> child_guard(child.lock());
+    if (child->type == extent_protocol::T_DIR && !dir_empty(child.get()))
+    {
+      return -ENOTEMPTY;
+    }
+    uint64_t size = get_file_size(e->inum);
+    if (child->type != extent_protocol::T_DIR && size > max_size)
+    {
+      truncate_file(e->inum, size - max_size);
+      return -EAGAIN;
+    }
   }
-  free(ino);
+  inum = e->inum;
+  dirent_remove(e, prev);
+  b.mark_dirty();
+  ino->mtime = time(NULL);
+  ino->ctime = time(NULL);
+  put_inode(parent_inum, ino.get());
+  return 0;
 }
 
-void inode_manager::read_blockid(uint32_t inum, std::vector<blockid_t> &blocks) const
+// Remove the entry for inum, searching the whole directory.
+void inode_manager::remove_from_dir(uint32_t parent_inum, uint32_t inum)
 {
-  struct inode* ino = get_inode(inum);
-  if (ino == NULL)
+  inode_ref ino = get_inode(parent_inum);
+  if (!ino)
   {
     return;
   }
-
-  for (uint32_t i = 0; i < MIN(ino->size, NDIRECT); ++i)
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+  if (ino->type != extent_protocol::T_DIR)
   {
-    blocks.push_back(ino->blocks[i]);
+    return;
   }
 
-  if (ino->size > NDIRECT)
+  std::vector<blockid_t> block_ids;
+  read_blockid(parent_inum, block_ids);
+  for (auto block_id : block_ids)
   {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)];
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    buf_ref b = bm->get_block(block_id);
+    struct dir_entry *prev = NULL;
+    for (uint32_t off = 0; off < bs; )
     {
-      if (inum_buf[i] == 0)
+      struct dir_entry *e = (struct dir_entry *)(b.data() + off);
+      if (e->rec_len == 0)
       {
         break;
       }
-      std::vector<blockid_t> temp_blocks;
-      read_blockid(inum_buf[i], temp_blocks);
-      blocks.insert(blocks.end(), temp_blocks.begin(), temp_blocks.end());
+      if (e->inum == inum)
+      {
+        dirent_remove(e, prev);
+        b.mark_dirty();
+        ino->mtime = time(NULL);
+        ino->ctime = time(NULL);
+        put_inode(parent_inum, ino.get());
+        return;
+      }
+      prev = e;
+      off += e->rec_len;
     }
   }
-
-  free(ino);
 }
 
-void inode_manager::free_and_find_last(uint32_t parent_inum, uint32_t inum, uint32_t &index, blockid_t &last_block_id, uint32_t &last_block_index)
+void inode_manager::set_attr(uint32_t inum, size_t size)
 {
-  struct inode *ino = get_inode(parent_inum);
-  if (ino == NULL)
+  inode_ref ino = get_inode(inum);
+  if (!ino)
   {
     return;
   }
-  if (ino->type != extent_protocol::T_DIR)
+  std::unique_lock<std::shared_mutex> guard(ino.lock());
+  uint64_t attr_size = get_file_size(inum);
+  if (size < attr_size)
   {
-    free(ino);
-    return;
+    truncate_file(inum, size);
   }
-
-  std::vector<blockid_t> block_ids;
-  read_blockid(parent_inum, block_ids);
-  index = 0;
-  for (auto block_id : block_ids)
+  else if (size > attr_size)
   {
-    char buf[BLOCK_SIZE] = {0};
-    bm->read_block(block_id, buf);
-    uint32_t read_inum = 0;
-    memcpy(&read_inum, buf, sizeof(uint32_t));
-    if (read_inum == inum)
-    {
-      bm->free_block(block_id);
-      break;
-    }
-    index += 1;
+    padding_file(inum, size);
   }
+}
 
-  last_block_id = block_ids.back();
-  last_block_index = block_ids.size() - 1;
-  free(ino);
+// Log blocks an operation may need to allocate, free or partly write
+// bytes of file data: at worst a bitmap block and a map block for every
+// data block, and the blocks at either end, on top of OP_BLOCKS.
+uint32_t inode_manager::op_blocks(uint64_t bytes) const
+{
+  uint64_t n = OP_BLOCKS + (bytes == 0 ? 0 : 2 * (bytes / bs + 2));
+  return MIN(n, (uint64_t)UINT32_MAX);
 }
 
-bool inode_manager::set_ino_block_id(uint32_t &parent_inum, uint32_t index, blockid_t block_id, bool auto_free)
+// Most file data one operation may cover, so that op_blocks of it fits
+// what the journal lets an operation log. Bigger writes and truncations
+// are split into operations of this size.
+uint64_t inode_manager::op_bytes() const
 {
-  struct inode *ino = get_inode(parent_inum);
-  if (ino == NULL)
-  {
-    return false;
-  }
-  if (ino->type != extent_protocol::T_DIR)
+  uint32_t max = bm->max_op();
+  if (max == UINT32_MAX)
   {
-    free(ino);
-    return false;
+    return UINT64_MAX;
   }
+  uint64_t blocks = max >= OP_BLOCKS + 6 ? (max - OP_BLOCKS) / 2 - 2 : 1;
+  return blocks * bs;
+}
+
+uint64_t inode_manager::get_file_size(uint32_t inum) const
+{
+  inode_ref ino = get_inode(inum);
+  return ino ? ino->size : 0;
+}
 
-  bool set_success = false;
-  if (index < MIN(ino->size, NDIRECT))
+// Shrink inum to size bytes. Blocks past the end are freed and the tail
+// of the new last block is zeroed, so the file reads back zeros if it
+// grows again.
+void inode_manager::truncate_file(uint32_t inum, size_t size)
+{
+  inode_ref ino = get_inode(inum);
+  uint32_t remain_blocks = size / bs + (size % bs != 0);
+  bmap_free(ino.get(), remain_blocks);
+  if (size % bs != 0)
   {
-    ino->blocks[index] = block_id;
-    if (block_id == 0)
-    {
-      ino->size -= 1;
-    }
-    if (ino->size == 0 && auto_free)
+    blockid_t id = bmap(ino.get(), remain_blocks - 1);
+    if (id != 0)
     {
-      free_inode(parent_inum);
-      parent_inum = 0;
+      buf_ref b = bm->get_block(id);
+      memset(b.data() + size % bs, 0, bs - size % bs);
+      b.mark_dirty();
     }
-    else
-    {
-      put_inode(parent_inum, ino);
-    }
-
-    set_success = true;
   }
-  else if (ino->size > NDIRECT && index > NDIRECT)
+  ino->nblocks = remain_blocks;
+  ino->size = size;
+  ino->mtime = time(NULL);
+  put_inode(inum, ino.get());
+}
+
+// Grow inum to size bytes with zeroed blocks.
+void inode_manager::padding_file(uint32_t inum, size_t size)
+{
+  inode_ref ino = get_inode(inum);
+  uint32_t final_blocks = size / bs + (size % bs != 0);
+  while (ino->nblocks < final_blocks)
   {
-    uint32_t inum_buf[BLOCK_SIZE / sizeof(uint32_t)] = {0};
-    bm->read_block(ino->blocks[NDIRECT], (char *)inum_buf);
-    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i)
+    uint32_t len = 0;
+    blockid_t start = bm->alloc_extent(final_blocks - ino->nblocks, len);
+    if (start == 0 || !zero_blocks(start, len))
     {
-      if (inum_buf[i] == 0)
-      {
-        break;
-      }
-      if (set_ino_block_id(inum_buf[i], index - (i + 1) * NDIRECT, block_id, true))
-      {
-        set_success = true;
-        if (i == 0 && inum_buf[0] == 0)
-        {
-          bm->free_block(ino->blocks[ino->size - 1]);
-          ino->blocks[ino->size - 1] = 0;
-          ino->size = NDIRECT;
-          put_inode(parent_inum, ino);
-        }
-        break;
-      }
+      throw std::bad_alloc();
     }
+    bmap_append(ino.get(), ino->nblocks, start, len);
+    ino->nblocks += len;
   }
-  free(ino);
-  return set_success;
-}
\ No newline at end of file
+  ino->size = size;
+  ino->mtime = time(NULL);
+  put_inode(inum, ino.get());
+}
@@ -5,119 +5,527 @@
 
 #include <stdint.h>
 #include <time.h>
+#include <sys/uio.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <exception>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
 #include "extent_protocol.h"
+#include "buffer_cache.h"
+#include "journal.h"
+#include "segment_log.h"
+#include "disk_io.h"
 
+// Default geometry, used when formatting a disk. A mounted disk takes its
+// geometry from the superblock instead (see block_manager::mkfs).
 #define DISK_SIZE 1024 * 1024 * 16 * 64
 #define BLOCK_SIZE 512
 #define BLOCK_NUM (DISK_SIZE / BLOCK_SIZE)
 
+// Supported block sizes, powers of two in between.
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 4096
+
 typedef uint32_t blockid_t;
 
 // disk layer -----------------------------------------
 
+// The disk is a mapping of the whole image. With an image path it is a
+// MAP_SHARED view of that file, so the data outlives the process; without
+// one it is anonymous memory. Either way pages are only touched on use.
+//
+// Block copies are specialized per block size and picked once by
+// set_block_size(), so they compile to fixed-size moves.
+//
+// On a log-structured disk, block numbers from the segment log's first
+// mapped block on go through it instead (see segment_log); raw_block
+// always addresses the image itself.
 class disk
 {
 private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char *blocks;
+  uint64_t bytes;
+  uint32_t block_size;
+  int fd;
+  bool fresh;
+  segment_log *segs;
+  io_backend *io; // NULL: transfers are copies through the mapping
+  std::atomic<bool> unsynced; // written by write_range or submit since the last sync
+  void (*read_fn)(const unsigned char *, uint32_t, char *);
+  void (*write_fn)(unsigned char *, uint32_t, const char *);
 
 public:
-  disk();
-  void read_block(uint32_t id, char *buf) const;
-  void write_block(uint32_t id, const char *buf);
+  disk(const char *image, uint64_t size);
+  ~disk();
+  bool is_fresh() const { return fresh; }
+  uint64_t size() const { return bytes; }
+  bool set_block_size(uint32_t block_size);
+  void set_segments(segment_log *segs) { this->segs = segs; }
+  void read_block(uint32_t id, char *buf) const
+  {
+    if (segs != NULL)
+    {
+      segs->read(id, 1, buf);
+      return;
+    }
+    read_fn(blocks, id, buf);
+  }
+  // Writes return false if a log-structured disk has no room left.
+  bool write_block(uint32_t id, const char *buf)
+  {
+    if (segs != NULL)
+    {
+      return segs->write(id, 1, buf);
+    }
+    write_fn(blocks, id, buf);
+    return true;
+  }
+  void read_range(uint32_t id, uint32_t n, char *buf) const;
+  bool write_range(uint32_t id, uint32_t n, const char *buf);
+  void read_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt);
+  bool write_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt);
+  void start_io(const char *kind);
+  void submit(io_batch &b);
+  bool complete(io_batch &b);
+  void discard(uint32_t id);
+  const char *block_data(uint32_t id) const;
+  char *raw_block(uint32_t id) const { return (char *)blocks + (size_t)id * block_size; }
+  void sync();
+  void sync_range(uint32_t id, uint32_t n);
+  void sync_blocks(std::vector<uint32_t> ids);
+  void sync_written();
 };
 
 // block layer -----------------------------------------
 
+#define SB_MAGIC 0x63686673 // "chfs"
+
+// The superblock sits at byte 0 of the disk, so it can be found before
+// the block size is known.
+#define SBLOCK 0
+
+// Block numbers are 32 bits, with headroom for rounding up to whole
+// bitmap blocks. A disk with more blocks than that is only partly used.
+#define MAX_NBLOCKS (UINT32_MAX - MAX_BLOCK_SIZE * 8)
+
 typedef struct superblock
 {
-  uint32_t size;
+  uint32_t magic;
+  uint32_t block_size;
+  uint64_t size;
   uint32_t nblocks;
   uint32_t ninodes;
+  uint32_t bmap_start;   // first block of the free block bitmap
+  uint32_t imap_start;   // first block of the inode bitmap
+  uint32_t inode_start;  // first block of the inode table
+  uint32_t data_start;   // first data block
+  uint32_t nfree;        // free blocks, exact after a clean unmount
+  uint32_t nfree_inodes; // free inodes, likewise
+  uint32_t journal_start; // first block of the journal
+  uint32_t journal_len;   // 0 if the disk has no journal
+  uint32_t ckpt_start;    // two segment map checkpoints of ckpt_len blocks
+  uint32_t ckpt_len;
+  uint32_t seg_start;     // first block of the segments, 0 if blocks are written in place
+  uint32_t seg_blocks;    // blocks per segment
+  uint32_t nsegs;
 } superblock_t;
 
+// The free block bitmap is kept resident as 64-bit words laid out exactly
+// like the on-disk bitmap blocks (bit b of the disk is bit b % 64 of word
+// b / 64, little-endian), so a changed block is written straight from it.
+//
+// Free space is also indexed as extents, by start and by length, so
+// alloc_extent can hand out the best-fitting contiguous run. Only runs of
+// at least MIN_EXTENT blocks are indexed; shorter holes are left to the
+// bitmap, which keeps the index small and its upkeep O(1) on a
+// fragmented disk. The index is rebuilt from the bitmap at mount and
+// never stored.
+#define MIN_EXTENT 8
+
+// Default buffer cache budget and write-back interval, overridden by
+// CHFS_CACHE_SIZE and CHFS_FLUSH_MS (0 turns the flusher thread off).
+#define CACHE_SIZE (32 * 1024 * 1024)
+#define FLUSH_MS 1000
+
+// Default journal size when formatting, overridden by CHFS_JOURNAL_SIZE
+// (0 for none). A small disk gets at most 1/64 of its space.
+#define JOURNAL_SIZE (4 * 1024 * 1024)
+#define MIN_JOURNAL_BLOCKS (8 * OP_BLOCKS) // room for a few operations
+
+// A new disk is log-structured if CHFS_SEGMENT_SIZE gives it a segment
+// size; nblocks is then the size the file system sees, SEG_FILL percent
+// of the segment area. Segments must hold at least MIN_SEG_BLOCKS blocks.
+#define MIN_SEG_BLOCKS 16
+
 class block_manager
 {
 private:
   disk *d;
-  std::map<uint32_t, int> using_blocks;
+  buffer_cache *cache;
+  std::vector<uint64_t> bitmap;
+  uint32_t cursor; // next-fit position of alloc_block
+  std::map<blockid_t, uint32_t> free_extents;           // start -> length
+  std::set<std::pair<uint32_t, blockid_t> > free_sizes; // (length, start)
+  std::mutex alloc_m; // the bitmap, the free extent index, cursor, freed and sb.nfree
+  journal *log;
+  segment_log *segs;
+  std::vector<blockid_t> freed;    // freed in the running transaction
+  std::vector<blockid_t> released; // released for the commit under way
+  blockid_t take_block();
+  void release_block(blockid_t id);
+  void release_freed();
+  void committed();
   bool is_free(blockid_t id) const;
   void mark_bit(blockid_t id);
   void unmark_bit(blockid_t id);
+  void mark_bits(blockid_t start, uint32_t len);
+  void write_bitmap_block(blockid_t id);
+  blockid_t find_free(blockid_t from) const;
+  void build_extent_index();
+  void index_insert(blockid_t start, uint32_t len);
+  void index_erase(std::map<blockid_t, uint32_t>::iterator it);
+  void index_take(blockid_t start, uint32_t len);
+  void index_give(blockid_t id);
+  void load_bitmap();
+  bool mount();
+  void mkfs(uint32_t block_size, uint32_t ninodes, uint64_t journal_size, uint64_t segment_size);
+  void write_super();
 
 public:
   block_manager();
+  ~block_manager();
   struct superblock sb;
+  bool formatted; // true if the disk was formatted by this mount
 
   uint32_t alloc_block();
+  blockid_t alloc_extent(uint32_t n, uint32_t &len);
   void free_block(uint32_t id);
   void read_block(uint32_t id, char *buf) const;
   void write_block(uint32_t id, const char *buf);
+  void read_range(uint32_t id, uint32_t n, char *buf) const;
+  bool write_range(uint32_t id, uint32_t n, const char *buf);
+  void read_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt);
+  bool write_blocks(const blockid_t *ids, uint32_t n, const struct iovec *iov, int iovcnt);
+  void submit(io_batch &b);
+  bool complete(io_batch &b);
+  buf_ref get_block(uint32_t id);
+  buf_ref get_resident(uint32_t id);
+  const char *block_data(uint32_t id) const;
+  void sync();
+  void prefetch(const blockid_t *ids, uint32_t n);
+  void get_cache_stats(cache_stats &st) const;
+  int begin_op(uint32_t nblocks);
+  void end_op(uint32_t nblocks);
+  uint32_t max_op() const;
 };
 
 // inode layer -----------------------------------------
 
-#define INODE_NUM 1024
-
-// Inodes per block.
-#define IPB 1
-//(BLOCK_SIZE / sizeof(struct inode))
-
-// Block containing inode i
-#define IBLOCK(i, nblocks) ((nblocks) / BPB + (i) / IPB + 3)
+// Default number of inodes, used when formatting.
+#define INODE_NUM 4096
 
 // Bitmap bits per block
-#define BPB (BLOCK_SIZE * 8)
+#define BPB(sb) ((sb).block_size * 8)
 
 // Block containing bit for block b
-#define BBLOCK(b) ((b) / BPB + 2)
+#define BBLOCK(b, sb) ((sb).bmap_start + (b) / BPB(sb))
+
+// A file maps its first NDIRECT blocks directly. The rest hang off a
+// single, a double and a triple indirect block, in that order, each index
+// block holding NINDIRECT block numbers. NDIRECT is chosen so an inode is
+// 128 bytes and packs evenly into any supported block size.
+#define NDIRECT 22
+#define NLEVELS 3
+#define NINDIRECT(sb) ((sb).block_size / sizeof(uint32_t))
+#define MAXFILE(sb) (NDIRECT + NINDIRECT(sb) + (uint64_t)NINDIRECT(sb) * NINDIRECT(sb) + \
+                     (uint64_t)NINDIRECT(sb) * NINDIRECT(sb) * NINDIRECT(sb))
+
+// Regular files and symlinks map their blocks as extents instead: runs of
+// (logical block, disk block, length). Up to EXT_ROOT_ENTRIES extents sit
+// in the inode itself, in place of blocks[]. Past that the inode holds the
+// root of a tree, ext4 style: index nodes of (first logical block, child
+// block) over leaf blocks of extents, all the same depth. Since files only
+// grow and shrink at the end, the tree only ever changes along its right
+// edge.
+#define INODE_EXTENTS 0x1
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+typedef struct extent_header
+{
+  uint16_t entries;
+  uint16_t depth; // 0 for a leaf
+} extent_header_t;
+
+typedef struct extent
+{
+  uint32_t lblk; // first logical block
+  blockid_t pblk; // first disk block
+  uint32_t len;
+} extent_t;
+
+typedef struct extent_idx
+{
+  uint32_t lblk; // first logical block under child
+  blockid_t child;
+} extent_idx_t;
+
+// Entries that fit in a node of size bytes at depth.
+#define EXT_MAX(size, depth) \
+  (((size) - sizeof(struct extent_header)) / ((depth) ? sizeof(struct extent_idx) : sizeof(struct extent)))
+#define EXT_ROOT_SIZE ((NDIRECT + NLEVELS) * sizeof(blockid_t))
+#define EXT_ROOT_ENTRIES EXT_MAX(EXT_ROOT_SIZE, 0)
 
 typedef struct inode
 {
   short type;
-  unsigned int size;
+  short flags;
+  unsigned int nblocks; // blocks in the file
+  uint64_t size;        // length in bytes
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT + 1]; // Data block addresses
+  blockid_t blocks[NDIRECT + NLEVELS]; // Data block addresses
 } inode_t;
 
+// Inodes per block.
+#define IPB(sb) ((sb).block_size / sizeof(struct inode))
+
+// Block containing inode i
+#define IBLOCK(i, sb) ((sb).inode_start + (i) / IPB(sb))
+
+// Block containing bit for inode i
+#define IMBLOCK(i, sb) ((sb).imap_start + (i) / BPB(sb))
+
+// In-core inodes kept once unreferenced.
+#define ICACHE_SIZE 1024
+
+// Directory blocks hold packed, variable-length entries, ext2 style.
+// rec_len runs to the next entry, so the entries of a block chain through
+// all of it; a live entry may have slack behind its name, and an entry
+// with inum 0 is free. Names are not NUL terminated.
+typedef struct dir_entry
+{
+  uint32_t inum;
+  uint16_t rec_len;
+  uint8_t name_len;
+  uint8_t type; // of the inode, see extent_protocol::types
+} dir_entry_t;
+
+#define DIR_NAME_MAX 255
+
+// Bytes an entry with a name of len bytes needs, kept 4-byte aligned.
+#define DIRENT_SIZE(len) ((sizeof(struct dir_entry) + (len) + 3) & ~3)
+
+// A directory that outgrows its first block is indexed, ext4 htree
+// style. Logical block 0 becomes the root of a tree of index nodes, each a
+// sorted array of (name hash, logical block) pairs; the bottom level
+// points at ordinary entry blocks, each holding the names whose hash falls
+// between its key and the next. A node starts with a free dir_entry
+// spanning the whole block, so walks over the entry blocks skip it. Name
+// hashes are even; an odd key marks a block continuing a run of equal
+// hashes from the block before it.
+#define INODE_HTREE 0x2
+
+typedef struct dx_entry
+{
+  uint32_t hash;
+  uint32_t block; // logical block in the directory
+} dx_entry_t;
+
+typedef struct dx_node
+{
+  struct dir_entry fake; // free, rec_len = block size
+  uint16_t count;
+  uint16_t levels; // index levels below this node, 0 if it points at leaves
+} dx_node_t;
+
+#define DX_MAX(bs) (((bs) - sizeof(struct dx_node)) / sizeof(struct dx_entry))
+
+// Position in one index node on the way down to a leaf.
+typedef struct dx_frame
+{
+  uint32_t lblk;
+  uint32_t pos;
+} dx_frame_t;
+
+class inode_cache;
+struct icache_entry;
+
+// A referenced in-core inode. All handles to one inum share the same
+// copy; changes reach the disk through inode_manager::put_inode.
+class inode_ref
+{
+private:
+  inode_cache *cache;
+  struct icache_entry *e;
+
+public:
+  inode_ref() : cache(NULL), e(NULL) {}
+  inode_ref(inode_cache *c, struct icache_entry *e) : cache(c), e(e) {}
+  inode_ref(inode_ref &&other) : cache(other.cache), e(other.e) { other.e = NULL; }
+  inode_ref &operator=(inode_ref &&other);
+  inode_ref(const inode_ref &) = delete;
+  inode_ref &operator=(const inode_ref &) = delete;
+  ~inode_ref() { release(); }
+
+  explicit operator bool() const { return e != NULL; }
+  struct inode *get() const;
+  std::shared_mutex &lock() const;
+  struct inode *operator->() const { return get(); }
+  void release();
+};
+
+// A file range as views of the blocks that hold it: buffers pinned in the
+// cache, or the disk image itself for blocks that are not cached. The
+// file stays read locked while the file_view lives, so no truncate or
+// write can change or reuse the blocks under the views.
+typedef struct file_view
+{
+  inode_ref ino;
+  std::shared_lock<std::shared_mutex> guard;
+  std::vector<struct iovec> iov;
+  std::vector<buf_ref> pins;
+  size_t bytes;
+  uint64_t size; // of the whole file
+} file_view_t;
+
+// In-core inodes, looked up by inum and refcounted. Unreferenced inodes
+// stay cached in LRU order until there are more than `limit` of them.
+// The cache is write-through: put() updates the inode's disk block (in
+// the buffer cache) at once, so an entry is never dirty and eviction is
+// just a free. Each entry also carries the inode's reader/writer lock,
+// which lives as long as someone holds a reference. A miss reads the
+// inode block without holding m; others that want the inode meanwhile
+// wait on cv for the entry to be loaded.
+class inode_cache
+{
+private:
+  block_manager *bm;
+  size_t limit;
+  std::unordered_map<uint32_t, struct icache_entry *> map;
+  std::list<struct icache_entry *> lru; // unreferenced, most recent first
+  std::mutex m;
+  std::condition_variable cv; // an entry finished loading
+
+public:
+  inode_cache(block_manager *bm, size_t limit);
+  ~inode_cache();
+  inode_ref get(uint32_t inum);
+  void put(uint32_t inum, const struct inode *ino);
+  void unref(struct icache_entry *e);
+};
+
+// Public operations lock the inodes they work on, shared to read and
+// exclusive to change; the private helpers expect the caller to hold the
+// lock. Directory operations lock only the directory.
 class inode_manager
 {
 private:
   block_manager *bm;
-  struct inode *get_inode(uint32_t inum) const;
-  void put_inode(uint32_t inum, struct inode *ino);
+  uint32_t bs; // block size of the mounted disk
+  inode_cache *icache;
+  std::vector<uint64_t> imap; // inode bitmap, laid out like the block bitmap
+  uint32_t icursor;           // next-fit position of alloc_inode
+  std::mutex imap_m;          // imap, icursor and sb.nfree_inodes
+  void format_imap();
+  void load_imap();
+  void write_imap_block(uint32_t inum);
+  inode_ref get_inode(uint32_t inum) const;
+  void put_inode(uint32_t inum, const struct inode *ino);
   uint32_t find_free_inode() const;
-  uint32_t get_ino_block_num(uint32_t inum) const;
-  uint32_t get_file_block_num(uint32_t inum) const;
-  uint32_t get_file_size(uint32_t inum) const;
-  int32_t last_non_zero_element_index_in_block(blockid_t id) const;
+  uint64_t get_file_size(uint32_t inum) const;
+  uint64_t max_blocks(const struct inode *ino) const;
+  int read_data(const struct inode *ino, uint64_t off, uint32_t len, char *buf) const;
+  bool dir_add(uint32_t parent_inum, struct inode *ino, uint32_t inum, const std::string &name);
   void truncate_file(uint32_t inum, size_t size);
   void padding_file(uint32_t inum, size_t size);
-  void ino_next_block(uint32_t inum, uint32_t iter, blockid_t &id) const;
+  bool bmap_locate(uint32_t n, uint32_t &slot, uint32_t &depth, uint64_t &off) const;
+  uint64_t bmap_span(uint32_t depth) const;
+  blockid_t bmap(const struct inode *ino, uint32_t n, uint32_t *run = NULL) const;
+  void bmap_set(struct inode *ino, uint32_t n, blockid_t id);
+  void bmap_free(struct inode *ino, uint32_t from);
+  bool bmap_free_tree(blockid_t id, uint32_t depth, uint64_t from);
+  blockid_t alloc_index_block();
   void read_blockid(uint32_t inum, std::vector<blockid_t> &blocks) const;
-  void free_and_find_last(uint32_t parent_inum, uint32_t inum, uint32_t &index, blockid_t &last_block_id, uint32_t &last_block_index);
-  bool set_ino_block_id(uint32_t &parent_inum, uint32_t index, blockid_t last_block_id, bool auto_free=false);
-  std::string array_to_string(const char *buf, uint32_t size) const;
+  void read_blockid_tree(blockid_t id, uint32_t depth, uint64_t &remain, std::vector<blockid_t> &blocks) const;
+  void bmap_append(struct inode *ino, uint32_t n, blockid_t start, uint32_t len);
+  blockid_t ext_bmap(const struct inode *ino, uint32_t n, uint32_t *run) const;
+  bool ext_insert(char *node, uint32_t size, const struct extent &e, struct extent_idx &split);
+  void ext_append(struct inode *ino, const struct extent &e);
+  bool ext_free(char *node, uint32_t from);
+  void ext_collect(const char *node, std::vector<struct extent> &extents) const;
+  blockid_t alloc_ext_node(uint16_t depth);
+  bool zero_blocks(blockid_t start, uint32_t len);
+  uint32_t dir_append_block(struct inode *ino);
+  void dx_convert(struct inode *ino);
+  void dx_find(const struct inode *ino, uint32_t hash, std::vector<dx_frame> &path) const;
+  bool dx_next(const struct inode *ino, std::vector<dx_frame> &path, uint32_t hash) const;
+  uint32_t dx_leaf(const struct inode *ino, const std::vector<dx_frame> &path) const;
+  void dx_insert(struct inode *ino, std::vector<dx_frame> &path, uint32_t level, uint32_t hash, uint32_t lblk);
+  struct dir_entry *dir_search(const struct inode *ino, const std::string &name, buf_ref &b,
+                              struct dir_entry **prev) const;
+  bool dir_empty(const struct inode *ino) const;
+  void dx_split_leaf(struct inode *ino, const std::vector<dx_frame> &path, uint32_t inum,
+                     const std::string &name, uint8_t type);
 
 public:
   inode_manager();
+  ~inode_manager();
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size) const;
-  void write_file(uint32_t inum, const char *buf, int size);
+  int read_file(uint32_t inum, uint64_t off, uint32_t len, char *buf) const;
+  int read_view(uint32_t inum, uint64_t off, uint32_t len, file_view &v) const;
+  void prefetch(uint32_t inum, uint64_t off, uint32_t len) const;
+  int write_file(uint32_t inum, const char *buf, int size);
+  int write_file(uint32_t inum, uint64_t off, const char *buf, uint32_t len);
+  uint64_t max_file_size(uint32_t inum) const;
   void remove_file(uint32_t inum);
   void get_attr(uint32_t inum, extent_protocol::attr &a) const;
   void read_dir(uint32_t inum, std::vector<std::pair<extent_protocol::extentid_t, std::string>> &bufs) const;
   void add_to_dir(uint32_t parent_inum, uint32_t inum, std::string name);
+  bool create_in(uint32_t parent_inum, const std::string &name, uint32_t type, uint32_t &inum);
+  uint32_t lookup(uint32_t parent_inum, const std::string &name) const;
+  int unlink(uint32_t parent_inum, const std::string &name, uint32_t &inum, uint64_t max_size);
   void remove_from_dir(uint32_t parent_inum, uint32_t inum);
   void set_attr(uint32_t inum, size_t size);
+  uint32_t op_blocks(uint64_t bytes) const;
+  uint64_t op_bytes() const;
+  int begin_op(uint32_t nblocks) { return bm->begin_op(nblocks); }
+  void end_op(uint32_t nblocks) { bm->end_op(nblocks); }
+};
+
+// Runs one file system operation as part of a journal transaction for as
+// long as it lives, see block_manager::begin_op. bytes bounds the file
+// data it allocates, frees or partly writes, and must not be more than
+// inode_manager::op_bytes. If failed(), the operation must not run and
+// should report ENOSPC.
+class txn
+{
+private:
+  inode_manager *im;
+  uint32_t nblocks;
+  int status;
+
+public:
+  txn(inode_manager *im, uint64_t bytes = 0)
+    : im(im), nblocks(im->op_blocks(bytes)), status(im->begin_op(nblocks)) {}
+  ~txn()
+  {
+    if (status == 0)
+    {
+      im->end_op(nblocks);
+    }
+  }
+  bool failed() const { return status != 0; }
+  txn(const txn &) = delete;
+  txn &operator=(const txn &) = delete;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,323 @@
+#include "journal.h"
+#include "buffer_cache.h"
+#include "inode_manager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+
+journal::journal(disk *d, uint32_t start, uint32_t len, uint32_t block_size)
+  : d(d), cache(NULL), start(start), len(len), block_size(block_size), seq(0),
+    outstanding(0), reserved(0), max_txn(0), committing(false), failed(false), commit_ms(0),
+    stopping(false)
+{
+  max_txn = capacity();
+}
+
+journal::~journal()
+{
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stopping = true;
+  }
+  stop_cv.notify_all();
+  if (committer.joinable())
+  {
+    committer.join();
+  }
+}
+
+// Blocks needed for the home block numbers of n logged blocks.
+uint32_t journal::tag_blocks(uint32_t n) const
+{
+  return (n * sizeof(uint32_t) + block_size - 1) / block_size;
+}
+
+// Most blocks one transaction can log.
+uint32_t journal::capacity() const
+{
+  return (uint64_t)(len - 1) * block_size / (block_size + sizeof(uint32_t));
+}
+
+void journal::write_header(uint32_t nblocks)
+{
+  char buf[MAX_BLOCK_SIZE] = {0};
+  struct journal_header *h = (struct journal_header *)buf;
+  h->magic = JOURNAL_MAGIC;
+  h->seq = seq;
+  h->nblocks = nblocks;
+  d->write_block(start, buf);
+  d->sync_range(start, 1);
+}
+
+// Start out with an empty log.
+void journal::format()
+{
+  write_header(0);
+}
+
+// Read the home block numbers of the transaction the log holds into
+// tags. Return its size, 0 if there is none or, with block numbers
+// outside [start + len, nblocks), if the log is not ours.
+uint32_t journal::logged_txn(uint32_t nblocks, std::vector<uint32_t> &tags)
+{
+  char buf[MAX_BLOCK_SIZE];
+  d->read_block(start, buf);
+  struct journal_header h;
+  memcpy(&h, buf, sizeof(h));
+  seq = h.seq;
+  if (h.magic != JOURNAL_MAGIC || h.nblocks == 0)
+  {
+    return 0;
+  }
+  uint32_t ntags = tag_blocks(h.nblocks);
+  if (h.nblocks > capacity())
+  {
+    printf("\tjournal: bad header, %u blocks\n", h.nblocks);
+    return 0;
+  }
+
+  tags.resize((size_t)ntags * block_size / sizeof(uint32_t));
+  d->read_range(start + 1, ntags, (char *)tags.data());
+  for (uint32_t i = 0; i < h.nblocks; ++i)
+  {
+    if (tags[i] < start + len || tags[i] >= nblocks)
+    {
+      printf("\tjournal: bad block %u in transaction %u\n", tags[i], h.seq);
+      return 0;
+    }
+  }
+  return h.nblocks;
+}
+
+// Copy what replay will install among the n blocks from id on over buf,
+// for a caller that must read them before replay runs.
+void journal::overlay(uint32_t nblocks, uint32_t id, uint32_t n, char *buf)
+{
+  std::vector<uint32_t> tags;
+  uint32_t count = logged_txn(nblocks, tags);
+  uint32_t ntags = tag_blocks(count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (tags[i] >= id && tags[i] < id + n)
+    {
+      memcpy(buf + (size_t)(tags[i] - id) * block_size, d->block_data(start + 1 + ntags + i), block_size);
+    }
+  }
+}
+
+// Install the transaction the log holds, if any, and empty it.
+void journal::replay(uint32_t nblocks)
+{
+  std::vector<uint32_t> tags;
+  uint32_t count = logged_txn(nblocks, tags);
+  if (count == 0)
+  {
+    write_header(0);
+    return;
+  }
+  uint32_t ntags = tag_blocks(count);
+  printf("\tjournal: replaying transaction %u, %u blocks\n", seq, count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    d->write_block(tags[i], d->block_data(start + 1 + ntags + i));
+  }
+  d->sync();
+  write_header(0);
+}
+
+// Log blocks dirtied in cache from now on, committing every commit_ms
+// (never if 0). prepare runs at each commit once the operations have
+// drained, and may dirty more blocks for it, as long as the operations
+// reserved them. committed runs once the commit is on disk, before any
+// new operation starts.
+void journal::start_logging(buffer_cache *cache, int commit_ms, std::function<void()> prepare,
+                            std::function<void()> committed)
+{
+  this->cache = cache;
+  max_txn = std::min<size_t>(capacity(), cache->budget());
+  this->commit_ms = commit_ms;
+  this->prepare = prepare;
+  this->committed = committed;
+  cache->set_logging(true);
+  if (commit_ms > 0)
+  {
+    committer = std::thread(&journal::commit_loop, this);
+  }
+}
+
+// Open an operation that logs at most nblocks blocks. It waits until the
+// running transaction can take them on top of what the operations in
+// flight may still log, committing it if none are left. Return -ENOSPC
+// if no transaction can hold that many, or if a transaction could not
+// be installed and the log is stuck with it.
+int journal::begin_op(uint32_t nblocks)
+{
+  std::unique_lock<std::mutex> lock(m);
+  for (;;)
+  {
+    if (failed || nblocks > max_txn)
+    {
+      return -ENOSPC;
+    }
+    else if (committing)
+    {
+      cv.wait(lock);
+    }
+    else if (cache->logged() + reserved + nblocks <= max_txn)
+    {
+      break;
+    }
+    else if (outstanding == 0)
+    {
+      lock.unlock();
+      commit();
+      lock.lock();
+    }
+    else
+    {
+      cv.wait(lock);
+    }
+  }
+  ++outstanding;
+  reserved += nblocks;
+  return 0;
+}
+
+// Close an operation opened with begin_op(nblocks). Its blocks are
+// committed with the rest of the transaction later; commit now if the
+// transaction is getting big.
+void journal::end_op(uint32_t nblocks)
+{
+  bool full;
+  {
+    std::lock_guard<std::mutex> lock(m);
+    --outstanding;
+    reserved -= nblocks;
+    cv.notify_all();
+    full = !committing && cache->logged() >= max_txn / 2;
+  }
+  if (full)
+  {
+    commit();
+  }
+}
+
+// Commit the running transaction: wait for the operations in it to end,
+// keep new ones out, and write it.
+void journal::commit()
+{
+  std::unique_lock<std::mutex> lock(m);
+  while (committing)
+  {
+    cv.wait(lock);
+  }
+  if (failed)
+  {
+    return;
+  }
+  committing = true;
+  while (outstanding > 0)
+  {
+    cv.wait(lock);
+  }
+  lock.unlock();
+
+  if (prepare)
+  {
+    prepare();
+  }
+  std::vector<struct buf *> bufs;
+  cache->take_logged(bufs);
+  bool ok = bufs.empty() || write_txn(bufs);
+  if (committed)
+  {
+    committed();
+  }
+
+  lock.lock();
+  failed = !ok;
+  committing = false;
+  cv.notify_all();
+}
+
+// Log bufs, commit them and install them in place. Nothing changes the
+// buffers meanwhile, since no operation is running. Return false if a
+// log-structured disk had no room to install them: the transaction is
+// then left in the log for the next mount to replay, and the buffers
+// not installed stay in the cache.
+bool journal::write_txn(const std::vector<struct buf *> &bufs)
+{
+  uint32_t n = bufs.size();
+  ++seq;
+  if (n > capacity())
+  {
+    // Some operation logged more than it reserved in begin_op. Rather
+    // than lose the blocks, install them unlogged, open to a crash.
+    printf("\tjournal: transaction %u of %u blocks overflows the log\n", seq, n);
+    d->sync_written();
+    return install(bufs);
+  }
+  uint32_t ntags = tag_blocks(n);
+  std::vector<uint32_t> tags((size_t)ntags * block_size / sizeof(uint32_t), 0);
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    tags[i] = bufs[i]->id;
+    d->write_block(start + 1 + ntags + i, bufs[i]->data);
+  }
+  for (uint32_t i = 0; i < ntags; ++i)
+  {
+    d->write_block(start + 1 + i, (const char *)tags.data() + (size_t)i * block_size);
+  }
+  // the log, and file data written in place, are on disk before the
+  // commit record
+  d->sync_range(start + 1, ntags + n);
+  d->sync_written();
+  write_header(n);
+
+  if (!install(bufs))
+  {
+    printf("\tjournal: no room to install transaction %u, left in the log\n", seq);
+    return false;
+  }
+  write_header(0);
+  return true;
+}
+
+// Write bufs to their home blocks and flush them. Return false, with the
+// buffers from the first that did not fit on still logged, if the disk
+// had no room for them.
+bool journal::install(const std::vector<struct buf *> &bufs)
+{
+  std::vector<uint32_t> ids;
+  for (size_t i = 0; i < bufs.size(); ++i)
+  {
+    if (!d->write_block(bufs[i]->id, bufs[i]->data))
+    {
+      return false;
+    }
+    ids.push_back(bufs[i]->id);
+    cache->installed(bufs[i]);
+  }
+  d->sync_blocks(ids);
+  return true;
+}
+
+void journal::commit_loop()
+{
+  std::unique_lock<std::mutex> lock(m);
+  while (!stopping)
+  {
+    stop_cv.wait_for(lock, std::chrono::milliseconds(commit_ms));
+    if (stopping)
+    {
+      break;
+    }
+    lock.unlock();
+    if (cache->logged() > 0)
+    {
+      commit();
+    }
+    lock.lock();
+  }
+}
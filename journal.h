@@ -0,0 +1,101 @@
+// metadata journal interface.
+
+#ifndef journal_h
+#define journal_h
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class disk;
+class buffer_cache;
+struct buf;
+
+#define JOURNAL_MAGIC 0x6a726e6c // "jrnl"
+
+// Log blocks reserved by an operation that changes a bounded number of
+// blocks: an inode, its map, a directory block, some bitmap.
+#define OP_BLOCKS 8
+
+// The first block of the journal region. A transaction is on disk once
+// this names it; nblocks is 0 when there is nothing to replay.
+typedef struct journal_header
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t nblocks;
+} journal_header_t;
+
+// Redo log of metadata blocks, kept in its own region of the disk:
+//
+// |<-header->|<-home block numbers->|<-block images->|
+//
+// File system operations run between begin_op and end_op. Every block
+// dirtied in the buffer cache meanwhile joins the running transaction
+// and is held in the cache, so nothing reaches its home location before
+// the transaction commits. Commits are grouped: a commit waits for the
+// operations in flight to end, holds off new ones, and logs all their
+// blocks in one sequential write. It then writes the commit record,
+// installs the blocks in place and clears the header again, so the log
+// only ever holds the last transaction and replay is a single pass.
+//
+// As in xv6, an operation states up front how many blocks it may log,
+// and begin_op holds it back until the running transaction has room for
+// them, so a transaction never outgrows the log. Nor does it outgrow the
+// buffer cache, which has to keep all its blocks. Operations on more data
+// than max_op() allows must be split by the caller; begin_op fails them.
+//
+// A commit runs every commit_ms, once the transaction reaches half its
+// limit, and on sync.
+class journal
+{
+private:
+  disk *d;
+  buffer_cache *cache;
+  uint32_t start;
+  uint32_t len;
+  uint32_t block_size;
+  uint32_t seq;
+  std::function<void()> prepare;   // run once the operations have drained
+  std::function<void()> committed; // run once the transaction is on disk
+
+  std::mutex m;
+  std::condition_variable cv;
+  int outstanding;   // operations in flight
+  uint32_t reserved; // blocks they may still log
+  uint32_t max_txn;  // most blocks a transaction holds
+  bool committing;
+  bool failed; // a transaction is stuck in the log, see write_txn
+
+  int commit_ms;
+  bool stopping;
+  std::condition_variable stop_cv;
+  std::thread committer;
+
+  uint32_t tag_blocks(uint32_t n) const;
+  uint32_t capacity() const;
+  void write_header(uint32_t nblocks);
+  bool write_txn(const std::vector<struct buf *> &bufs);
+  bool install(const std::vector<struct buf *> &bufs);
+  uint32_t logged_txn(uint32_t nblocks, std::vector<uint32_t> &tags);
+  void commit_loop();
+
+public:
+  journal(disk *d, uint32_t start, uint32_t len, uint32_t block_size);
+  ~journal();
+  void format();
+  void overlay(uint32_t nblocks, uint32_t id, uint32_t n, char *buf);
+  void replay(uint32_t nblocks);
+  void start_logging(buffer_cache *cache, int commit_ms, std::function<void()> prepare,
+                     std::function<void()> committed);
+  int begin_op(uint32_t nblocks);
+  void end_op(uint32_t nblocks);
+  void commit();
+  uint32_t max_op() const { return max_txn / 2; }
+};
+
+#endif
@@ -34,6 +34,9 @@
 
 #include "extent_client.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #define FILE_NUM 50
 #define LARGE_FILE_SIZE_MIN 512*10
@@ -232,6 +235,444 @@ int test_remove()
     return 0;
 }
 
+/* The tests below are not scored. They check corner cases of the layers
+ * under extent_server with fixed inputs, so a failure can be replayed.
+ */
+
+// Contents of block i of a test file.
+static std::string block_pattern(int i, char base)
+{
+    return std::string(512, base + i % 26);
+}
+
+int test_extent_tree()
+{
+    extent_protocol::extentid_t a, b;
+    extent_protocol::attr attr;
+    std::string want, buf;
+    int i, n = 600;
+
+    printf("========== begin test extent tree ==========\n");
+    if (ec->create(extent_protocol::T_FILE, a) != extent_protocol::OK ||
+        ec->create(extent_protocol::T_FILE, b) != extent_protocol::OK) {
+        iprint("error create, return not OK");
+        return 1;
+    }
+    // appending to two files in turn leaves each in many short extents,
+    // more than the inode holds, so the tree grows index levels
+    for (i = 0; i < n; i++) {
+        if (ec->write(a, (unsigned long long)i * 512, block_pattern(i, 'a')) != extent_protocol::OK ||
+            ec->write(b, (unsigned long long)i * 512, block_pattern(i, 'A')) != extent_protocol::OK) {
+            iprint("error write, return not OK");
+            return 2;
+        }
+        want += block_pattern(i, 'a');
+    }
+    ec->get(a, buf);
+    if (buf != want) {
+        iprint("error get, fragmented file not consistent with writes");
+        return 3;
+    }
+
+    // cut in the middle of a block, then grow over the cut
+    ec->set_attr(a, 300 * 512 + 100);
+    want.resize(300 * 512 + 100);
+    ec->get(a, buf);
+    if (buf != want) {
+        iprint("error get, truncated file not consistent");
+        return 4;
+    }
+    ec->set_attr(a, 400 * 512);
+    want.resize(400 * 512, '\0');
+    ec->get(a, buf);
+    if (buf != want) {
+        iprint("error get, regrown file does not read back zeros");
+        return 5;
+    }
+    ec->set_attr(a, 0);
+    memset(&attr, 0, sizeof(attr));
+    ec->getattr(a, attr);
+    ec->get(a, buf);
+    if (attr.size != 0 || !buf.empty()) {
+        iprint("error truncating to 0");
+        return 6;
+    }
+    // b lost nothing to a's truncates
+    ec->get(b, buf);
+    for (i = 0; i < n; i++) {
+        if (buf.compare((size_t)i * 512, 512, block_pattern(i, 'A')) != 0) {
+            iprint("error get, neighbour file changed by truncate");
+            return 7;
+        }
+    }
+    ec->remove(a);
+    ec->remove(b);
+    printf("========== pass test extent tree ==========\n");
+    return 0;
+}
+
+int test_ranged_io()
+{
+    extent_protocol::extentid_t id;
+    extent_protocol::attr a;
+    std::string buf;
+
+    printf("========== begin test ranged io ==========\n");
+    if (ec->create(extent_protocol::T_FILE, id) != extent_protocol::OK) {
+        iprint("error create, return not OK");
+        return 1;
+    }
+    ec->write(id, 0, std::string(1000, 'x'));
+    // past the end: the gap reads back as zeros
+    ec->write(id, 5000, std::string(100, 'y'));
+    std::string want = std::string(1000, 'x') + std::string(4000, '\0') + std::string(100, 'y');
+    ec->get(id, buf);
+    if (buf != want) {
+        iprint("error write past EOF, gap not zero filled");
+        return 2;
+    }
+    ec->read(id, 4990, 4096, buf);
+    if (buf != want.substr(4990)) {
+        iprint("error read across EOF, not cut short at the end");
+        return 3;
+    }
+    ec->read(id, 5100, 10, buf);
+    if (!buf.empty()) {
+        iprint("error read at EOF, not empty");
+        return 4;
+    }
+    ec->read(id, 1ULL << 40, 10, buf);
+    if (!buf.empty()) {
+        iprint("error read far past EOF, not empty");
+        return 5;
+    }
+
+    // a file cannot pass 2^32 blocks
+    if (ec->write(id, (unsigned long long)UINT32_MAX * 512, "z") != extent_protocol::FBIG) {
+        iprint("error write past the largest file, not FBIG");
+        return 6;
+    }
+    memset(&a, 0, sizeof(a));
+    ec->getattr(id, a);
+    if (a.size != want.size()) {
+        iprint("error FBIG write changed the file size");
+        return 7;
+    }
+
+    // prefetching, as readahead does, stops at the end of the file
+    ec->prefetch(id, 4000, 1 << 20);
+    ec->prefetch(id, 1 << 20, 4096);
+    memset(&a, 0, sizeof(a));
+    ec->getattr(id, a);
+    ec->get(id, buf);
+    if (a.size != want.size() || buf != want) {
+        iprint("error prefetch past EOF changed the file");
+        return 8;
+    }
+    ec->remove(id);
+    printf("========== pass test ranged io ==========\n");
+    return 0;
+}
+
+// Name of entry i in test_dirents; lengths vary so entries pack unevenly.
+static std::string dirent_name(int i)
+{
+    char num[16];
+    sprintf(num, "%d", i);
+    return std::string("entry-") + num + "-" + std::string(i % 40, 'n');
+}
+
+int test_dirents()
+{
+    extent_protocol::extentid_t dir, id;
+    std::vector<std::pair<extent_protocol::extentid_t, std::string>> ents;
+    std::vector<extent_protocol::extentid_t> ids;
+    int i, n = 3000;
+
+    printf("========== begin test dirents ==========\n");
+    if (ec->create(extent_protocol::T_DIR, dir) != extent_protocol::OK) {
+        iprint("error create dir, return not OK");
+        return 1;
+    }
+    // enough names to index the directory and split its leaves
+    for (i = 0; i < n; i++) {
+        if (ec->create_in(dir, dirent_name(i), extent_protocol::T_FILE, id) != extent_protocol::OK) {
+            iprint("error create_in, return not OK");
+            return 2;
+        }
+        ids.push_back(id);
+    }
+    if (ec->create_in(dir, dirent_name(7), extent_protocol::T_FILE, id) != extent_protocol::EXIST ||
+        id != ids[7]) {
+        iprint("error create_in of a taken name, not EXIST");
+        return 3;
+    }
+    for (i = 0; i < n; i++) {
+        ec->lookup(dir, dirent_name(i), id);
+        if (id != ids[i]) {
+            iprint("error lookup, wrong inode");
+            return 4;
+        }
+    }
+    ec->read_dir(dir, ents);
+    if ((int)ents.size() != n) {
+        iprint("error read_dir, wrong number of entries");
+        return 5;
+    }
+
+    // holes left by removed entries take new names
+    for (i = 0; i < n; i += 2) {
+        if (ec->unlink(dir, dirent_name(i), id) != extent_protocol::OK || id != ids[i]) {
+            iprint("error unlink, return not OK");
+            return 6;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        ec->lookup(dir, dirent_name(i), id);
+        if (id != (i % 2 == 0 ? 0 : ids[i])) {
+            iprint("error lookup after unlink");
+            return 7;
+        }
+    }
+    for (i = 0; i < n; i += 2) {
+        if (ec->create_in(dir, dirent_name(i) + "-again", extent_protocol::T_FILE, ids[i]) != extent_protocol::OK) {
+            iprint("error create_in after unlink, return not OK");
+            return 8;
+        }
+    }
+    ents.clear();
+    ec->read_dir(dir, ents);
+    if ((int)ents.size() != n) {
+        iprint("error read_dir after refill, wrong number of entries");
+        return 9;
+    }
+    if (ec->unlink(1, "no such name", id) != extent_protocol::NOENT) {
+        iprint("error unlink of a missing name, not NOENT");
+        return 10;
+    }
+    for (i = 0; i < n; i++) {
+        ec->unlink(dir, dirent_name(i) + (i % 2 == 0 ? "-again" : ""), id);
+    }
+    ents.clear();
+    ec->read_dir(dir, ents);
+    if (!ents.empty()) {
+        iprint("error read_dir, entries left after unlinking all");
+        return 11;
+    }
+    ec->remove(dir);
+    printf("========== pass test dirents ==========\n");
+    return 0;
+}
+
+int test_journal_replay()
+{
+    const uint32_t bs = 512, start = 1, len = 64, nblocks = 2048;
+    disk d(NULL, (uint64_t)nblocks * bs);
+    d.set_block_size(bs);
+    journal j(&d, start, len, bs);
+    char buf[512];
+
+    printf("========== begin test journal replay ==========\n");
+    j.format();
+    // a crash after the commit record, before any block was installed:
+    // |header|home block numbers|block images|
+    uint32_t homes[3] = {100, 101, 900};
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, homes, sizeof(homes));
+    d.write_block(start + 1, buf);
+    for (int i = 0; i < 3; i++) {
+        memset(buf, 'p' + i, sizeof(buf));
+        d.write_block(start + 2 + i, buf);
+    }
+    journal_header h = {JOURNAL_MAGIC, 7, 3};
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, &h, sizeof(h));
+    d.write_block(start, buf);
+
+    j.replay(nblocks);
+    for (int i = 0; i < 3; i++) {
+        d.read_block(homes[i], buf);
+        if (buf[0] != 'p' + i || buf[bs - 1] != 'p' + i) {
+            iprint("error replay, logged block not installed");
+            return 1;
+        }
+    }
+    d.read_block(start, buf);
+    memcpy(&h, buf, sizeof(h));
+    if (h.nblocks != 0) {
+        iprint("error replay, log not cleared");
+        return 2;
+    }
+
+    // a log naming blocks outside the disk is not replayed
+    h.nblocks = 1;
+    memcpy(buf, &h, sizeof(h));
+    d.write_block(start, buf);
+    homes[0] = nblocks + 5;
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, homes, sizeof(homes));
+    d.write_block(start + 1, buf);
+    memset(buf, 'q', sizeof(buf));
+    d.write_block(start + 2, buf);
+    j.replay(nblocks);
+    d.read_block(100, buf);
+    if (buf[0] != 'p') {
+        iprint("error replay of a bad log changed the disk");
+        return 3;
+    }
+    printf("========== pass test journal replay ==========\n");
+    return 0;
+}
+
+// Run fn in a child process, on a file system set up by the
+// environment settings in env, and return its exit status. The child's
+// disk dies with it unless CHFS_IMAGE keeps it in a file.
+static int in_child(const std::vector<std::string> &env, int (*fn)())
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (size_t i = 0; i < env.size(); i++) {
+            putenv(strdup(env[i].c_str()));
+        }
+        _exit(fn());
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+// Fill a small disk, then replace or extend a file: both fail with NOSPC
+// and leave the file as it was.
+static int nospc_child()
+{
+    extent_client c;
+    extent_protocol::extentid_t keep, fill;
+    std::string buf;
+    unsigned long long off = 0;
+    int r = 0;
+
+    c.create(extent_protocol::T_FILE, keep);
+    c.create(extent_protocol::T_FILE, fill);
+    c.put(keep, std::string(5000, 'k'));
+    while (c.write(fill, off, std::string(4000, 'f')) == extent_protocol::OK) {
+        off += 4000;
+    }
+    if (c.put(keep, std::string(20000, 'r')) != extent_protocol::NOSPC) {
+        r = 1;
+    } else if (c.write(keep, 5000, std::string(20000, 'w')) != extent_protocol::NOSPC) {
+        r = 2;
+    } else {
+        c.get(keep, buf);
+        if (buf != std::string(5000, 'k')) {
+            r = 3;
+        }
+    }
+    fflush(stdout);
+    return r;
+}
+
+int test_nospc()
+{
+    std::vector<std::string> env;
+    env.push_back("CHFS_DISK_SIZE=8M");
+
+    printf("========== begin test nospc ==========\n");
+    int r = in_child(env, nospc_child);
+    if (r != 0) {
+        printf("[TEST_ERROR]: error on a full disk, case %d\n", r);
+        return 1;
+    }
+    printf("========== pass test nospc ==========\n");
+    return 0;
+}
+
+#define LFS_FILES 400
+
+static std::string lfs_content(int i)
+{
+    char num[16];
+    sprintf(num, "%d,", i);
+    std::string s;
+    while (s.size() < 1500) {
+        s += num;
+    }
+    return s;
+}
+
+// Write files to a log-structured disk and die without syncing. Commits
+// happen only when a transaction fills up, so the same ones happen on
+// every run, and nothing checkpoints the segment map after the format.
+static int lfs_crash_child()
+{
+    extent_client *c = new extent_client();
+    extent_protocol::extentid_t id;
+    char name[16];
+    for (int i = 0; i < LFS_FILES; i++) {
+        sprintf(name, "lfs%d", i);
+        c->create_in(1, name, extent_protocol::T_FILE, id);
+        c->write(id, 0, lfs_content(i));
+    }
+    fflush(stdout);
+    _exit(0);
+}
+
+// Mount the disk again, rolling the segments forward: every file found
+// holds what was written to it, or nothing if its write was not
+// committed.
+static int lfs_check_child()
+{
+    extent_client c;
+    std::vector<std::pair<extent_protocol::extentid_t, std::string>> ents;
+    std::string buf;
+    int whole = 0;
+
+    c.read_dir(1, ents);
+    for (size_t i = 0; i < ents.size(); i++) {
+        c.get(ents[i].first, buf);
+        if (buf.empty()) {
+            continue;
+        }
+        if (buf != lfs_content(atoi(ents[i].second.c_str() + 3))) {
+            return 1;
+        }
+        whole++;
+    }
+    fflush(stdout);
+    return whole > 0 ? 0 : 2;
+}
+
+int test_lfs_rollforward()
+{
+    char img[] = "/tmp/part1_lfs_XXXXXX";
+    int fd = mkstemp(img);
+    if (fd < 0) {
+        iprint("error creating disk image");
+        return 1;
+    }
+    close(fd);
+    std::vector<std::string> env;
+    env.push_back(std::string("CHFS_IMAGE=") + img);
+    env.push_back("CHFS_DISK_SIZE=16M");
+    env.push_back("CHFS_SEGMENT_SIZE=64K");
+    env.push_back("CHFS_FLUSH_MS=0");
+
+    printf("========== begin test lfs roll forward ==========\n");
+    int r = in_child(env, lfs_crash_child);
+    if (r == 0) {
+        r = in_child(env, lfs_check_child);
+    }
+    unlink(img);
+    if (r != 0) {
+        printf("[TEST_ERROR]: error after crash on a log-structured disk, case %d\n", r);
+        return 2;
+    }
+    printf("========== pass test lfs roll forward ==========\n");
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -253,5 +694,14 @@ int main(int argc, char *argv[])
 test_finish:
     printf("---------------------------------\n");
     printf("Part1 score is : %d/100\n", total_score);
-    return 0;
+
+    int failed = 0;
+    failed += test_extent_tree() != 0;
+    failed += test_ranged_io() != 0;
+    failed += test_dirents() != 0;
+    failed += test_journal_replay() != 0;
+    failed += test_nospc() != 0;
+    failed += test_lfs_rollforward() != 0;
+    printf("Part1 extra tests failed : %d\n", failed);
+    return failed != 0;
 }
@@ -0,0 +1,473 @@
+#include "segment_log.h"
+#include "inode_manager.h"
+
+#include <algorithm>
+#include <chrono>
+
+segment_log::segment_log(disk *d, const struct superblock &sb)
+  : d(d), block_size(sb.block_size), first(sb.bmap_start), nblocks(sb.nblocks),
+    ckpt_start(sb.ckpt_start), ckpt_len(sb.ckpt_len), seg_start(sb.seg_start),
+    seg_blocks(sb.seg_blocks), nsegs(sb.nsegs),
+    sum_blocks(summary_blocks(sb.seg_blocks, sb.block_size)),
+    map(sb.nblocks, 0), owner((size_t)sb.nsegs * sb.seg_blocks, 0),
+    live(sb.nsegs, 0), seqs(sb.nsegs, 0),
+    head(sb.nsegs), next_slot(0), next_seq(1), ckpt_next(0), opened(0), cleaning(false),
+    stopping(false)
+{
+}
+
+segment_log::~segment_log()
+{
+  {
+    std::lock_guard<std::mutex> lock(stop_m);
+    stopping = true;
+  }
+  stop_cv.notify_all();
+  if (cleaner.joinable())
+  {
+    cleaner.join();
+  }
+}
+
+// Blocks taken by the summary of a segment of seg_blocks blocks.
+uint32_t segment_log::summary_blocks(uint32_t seg_blocks, uint32_t block_size)
+{
+  return (sizeof(struct seg_summary) + seg_blocks * sizeof(uint32_t) + block_size - 1) / block_size;
+}
+
+// The home block numbers in the summary of segment s.
+uint32_t *segment_log::entries(uint32_t s) const
+{
+  return (uint32_t *)(d->raw_block(seg_first(s)) + sizeof(struct seg_summary));
+}
+
+// Start out with nothing mapped and every segment free. On a used image,
+// summaries left from before would be rolled forward, so they are wiped.
+void segment_log::format()
+{
+  for (uint32_t s = nsegs; s-- > 0;)
+  {
+    if (!d->is_fresh())
+    {
+      memset(d->raw_block(seg_first(s)), 0, sizeof(struct seg_summary));
+    }
+    free_segs.push_back(s);
+  }
+  memset(d->raw_block(ckpt_start + ckpt_len), 0, block_size);
+  write_checkpoint();
+}
+
+// Load the newer checkpoint, roll it forward and rebuild the segment
+// usage from the map. Return false if there is no checkpoint.
+bool segment_log::load()
+{
+  struct checkpoint_header h[2];
+  int use = -1;
+  for (int i = 0; i < 2; ++i)
+  {
+    memcpy(&h[i], d->raw_block(ckpt_start + i * ckpt_len), sizeof(h[i]));
+    if (h[i].magic == CKPT_MAGIC && h[i].nblocks == nblocks && (use < 0 || h[i].seq > h[use].seq))
+    {
+      use = i;
+    }
+  }
+  if (use < 0)
+  {
+    return false;
+  }
+  memcpy(map.data(), d->raw_block(ckpt_start + use * ckpt_len + 1), (size_t)nblocks * sizeof(uint32_t));
+  ckpt_next = use ^ 1;
+  next_seq = h[use].seq;
+
+  std::vector<std::pair<uint32_t, uint32_t> > newer; // (seq, segment)
+  for (uint32_t s = 0; s < nsegs; ++s)
+  {
+    struct seg_summary sum;
+    memcpy(&sum, d->raw_block(seg_first(s)), sizeof(sum));
+    if (sum.magic == SEG_MAGIC && sum.seq >= h[use].seq)
+    {
+      newer.push_back(std::make_pair(sum.seq, s));
+    }
+  }
+  std::sort(newer.begin(), newer.end());
+  // seq of the segment each block was last mapped from; the checkpoint
+  // is older than every segment rolled forward
+  std::vector<uint32_t> mapped_seq(nblocks, 0);
+  for (size_t i = 0; i < newer.size(); ++i)
+  {
+    uint32_t s = newer[i].second;
+    uint32_t seq = newer[i].first;
+    const uint32_t *e = entries(s);
+    for (uint32_t slot = 0; slot < data_slots() && e[slot] != 0; ++slot)
+    {
+      if (e[slot] >= first && e[slot] < nblocks && seq >= mapped_seq[e[slot]])
+      {
+        map[e[slot]] = seg_first(s) + sum_blocks + slot;
+        mapped_seq[e[slot]] = seq;
+      }
+    }
+    next_seq = seq + 1;
+  }
+  if (!newer.empty())
+  {
+    printf("\tlfs: rolled forward %zu segments\n", newer.size());
+  }
+
+  for (uint32_t id = first; id < nblocks; ++id)
+  {
+    uint32_t p = map[id];
+    if (p == 0)
+    {
+      continue;
+    }
+    if (p < seg_start || p >= seg_first(nsegs) || (p - seg_start) % seg_blocks < sum_blocks)
+    {
+      printf("\tlfs: block %u maps outside the segments\n", id);
+      map[id] = 0;
+      continue;
+    }
+    // A block freed since the checkpoint may still be mapped to a slot
+    // that a reused segment has since given to another block. The
+    // summary says whose the slot is.
+    uint32_t s = (p - seg_start) / seg_blocks;
+    uint32_t slot = (p - seg_start) % seg_blocks - sum_blocks;
+    if (entries(s)[slot] != id || owner[p - seg_start] != 0)
+    {
+      map[id] = 0;
+      continue;
+    }
+    owner[p - seg_start] = id;
+    live[s]++;
+  }
+  for (uint32_t s = nsegs; s-- > 0;)
+  {
+    if (live[s] > 0)
+    {
+      seqs[s] = next_seq;
+    }
+    else
+    {
+      free_segs.push_back(s);
+    }
+  }
+  // segments freed above may be rewritten now, so fold the roll-forward in
+  write_checkpoint();
+  return true;
+}
+
+// Discard every mapped block from `from` on whose bit is clear in bitmap.
+// Frees only reach the map at checkpoints, so at mount it still holds
+// the blocks freed since, which would keep their segments from emptying.
+void segment_log::discard_free(const uint64_t *bitmap, uint32_t from)
+{
+  std::unique_lock<std::shared_mutex> lock(m);
+  for (uint32_t id = std::max(from, first); id < nblocks; ++id)
+  {
+    if (map[id] != 0 && !(bitmap[id / 64] >> (id % 64) & 1))
+    {
+      kill(map[id]);
+      map[id] = 0;
+    }
+  }
+}
+
+void segment_log::start_cleaner()
+{
+  cleaner = std::thread(&segment_log::clean_loop, this);
+}
+
+// Read n blocks from id on, copying runs that lie next to each other on
+// the disk in one go. Blocks never written read as zeros.
+void segment_log::read(uint32_t id, uint32_t n, char *buf)
+{
+  std::shared_lock<std::shared_mutex> lock(m);
+  for (uint32_t i = 0; i < n;)
+  {
+    uint32_t p = mapped(id + i) ? map[id + i] : id + i;
+    uint32_t run = 1;
+    if (mapped(id + i) && p == 0)
+    {
+      memset(buf + (size_t)i * block_size, 0, block_size);
+    }
+    else
+    {
+      while (i + run < n && mapped(id + i + run) && map[id + i + run] == p + run)
+      {
+        ++run;
+      }
+      memcpy(buf + (size_t)i * block_size, d->raw_block(p), (size_t)run * block_size);
+    }
+    i += run;
+  }
+}
+
+// Append n blocks from id on to the head segment. Return false, with
+// only some of them written, if the segments run out.
+bool segment_log::write(uint32_t id, uint32_t n, const char *buf)
+{
+  std::unique_lock<std::shared_mutex> lock(m);
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    if (mapped(id + i))
+    {
+      if (!append(id + i, buf + (size_t)i * block_size))
+      {
+        return false;
+      }
+    }
+    else
+    {
+      memcpy(d->raw_block(id + i), buf + (size_t)i * block_size, block_size);
+    }
+  }
+  return true;
+}
+
+// The file system no longer uses block id; its copy is dead.
+void segment_log::discard(uint32_t id)
+{
+  std::unique_lock<std::shared_mutex> lock(m);
+  if (mapped(id) && map[id] != 0)
+  {
+    kill(map[id]);
+    map[id] = 0;
+  }
+}
+
+// Write a checkpoint, after which the segments emptied so far are free.
+void segment_log::checkpoint()
+{
+  std::unique_lock<std::shared_mutex> lock(m);
+  write_checkpoint();
+  release_cleaned();
+}
+
+// A sync of the whole disk is starting: the copies out of the segments
+// emptied so far are about to be on disk.
+void segment_log::syncing()
+{
+  std::unique_lock<std::shared_mutex> lock(m);
+  synced.insert(synced.end(), cleaned.begin(), cleaned.end());
+  cleaned.clear();
+}
+
+// Flush the segments written to since the last flush, which holds every
+// block written since. Like a sync of the whole disk, this readies the
+// segments emptied so far for reuse.
+void segment_log::flush()
+{
+  std::unique_lock<std::shared_mutex> lock(m);
+  std::sort(written.begin(), written.end());
+  written.erase(std::unique(written.begin(), written.end()), written.end());
+  for (size_t i = 0; i < written.size(); ++i)
+  {
+    d->sync_range(seg_first(written[i]), seg_blocks);
+  }
+  written.clear();
+  if (head != nsegs)
+  {
+    // still being filled
+    written.push_back(head);
+  }
+  synced.insert(synced.end(), cleaned.begin(), cleaned.end());
+  cleaned.clear();
+}
+
+// A journal commit following the last sync is on disk: the segments
+// emptied before that sync may be reused.
+void segment_log::committed()
+{
+  std::unique_lock<std::shared_mutex> lock(m);
+  free_segs.insert(free_segs.end(), synced.begin(), synced.end());
+  synced.clear();
+}
+
+// Make every emptied segment free. Called with m held exclusively, once
+// the segment area is on disk.
+void segment_log::release_cleaned()
+{
+  free_segs.insert(free_segs.end(), synced.begin(), synced.end());
+  free_segs.insert(free_segs.end(), cleaned.begin(), cleaned.end());
+  synced.clear();
+  cleaned.clear();
+}
+
+// Write block id to the next slot of the head segment and point the map
+// at it. Return false if there is no free segment to write it to. Called
+// with m held exclusively.
+bool segment_log::append(uint32_t id, const char *buf)
+{
+  if (head == nsegs || next_slot == data_slots())
+  {
+    if (!cleaning && free_segs.size() + cleaned.size() + synced.size() < SEG_RESERVE)
+    {
+      // the cleaner fell behind, clean before taking the reserve
+      cleaning = true;
+      while (free_segs.size() + cleaned.size() + synced.size() < SEG_RESERVE && clean_one())
+      {
+      }
+      cleaning = false;
+    }
+    if ((head == nsegs || next_slot == data_slots()) && !open_segment())
+    {
+      return false;
+    }
+  }
+  uint32_t p = seg_first(head) + sum_blocks + next_slot;
+  memcpy(d->raw_block(p), buf, block_size);
+  entries(head)[next_slot++] = id;
+  if (map[id] != 0)
+  {
+    kill(map[id]);
+  }
+  map[id] = p;
+  owner[p - seg_start] = id;
+  live[head]++;
+  return true;
+}
+
+// Close the head segment and start filling a free one. Return false if
+// there is none.
+bool segment_log::open_segment()
+{
+  if (head != nsegs && live[head] == 0)
+  {
+    retire(head);
+  }
+  head = nsegs;
+  if (free_segs.empty() && !(cleaned.empty() && synced.empty()))
+  {
+    // the copies out of the emptied segments go to disk before those
+    // segments are overwritten; the frees that emptied them are already
+    // committed
+    d->sync_range(seg_start, nsegs * seg_blocks);
+    release_cleaned();
+  }
+  if (free_segs.empty())
+  {
+    printf("\tlfs: out of segments\n");
+    return false;
+  }
+  uint32_t s = free_segs.back();
+  free_segs.pop_back();
+  memset(d->raw_block(seg_first(s)), 0, (size_t)sum_blocks * block_size);
+  struct seg_summary sum = {SEG_MAGIC, next_seq};
+  memcpy(d->raw_block(seg_first(s)), &sum, sizeof(sum));
+  seqs[s] = next_seq++;
+  head = s;
+  written.push_back(s);
+  next_slot = 0;
+  ++opened;
+  return true;
+}
+
+// Segment s holds no live blocks any more.
+void segment_log::retire(uint32_t s)
+{
+  seqs[s] = 0;
+  cleaned.push_back(s);
+}
+
+// The copy at disk block pblk has been superseded.
+void segment_log::kill(uint32_t pblk)
+{
+  uint32_t i = pblk - seg_start;
+  owner[i] = 0;
+  uint32_t s = i / seg_blocks;
+  if (--live[s] == 0 && s != head)
+  {
+    retire(s);
+  }
+}
+
+// Copy the live blocks of the segment with the fewest to the head, which
+// empties it. Return false if no segment is worth cleaning or there is
+// no room to copy to. Called with m held exclusively.
+bool segment_log::clean_one()
+{
+  uint32_t victim = nsegs;
+  uint32_t best = data_slots();
+  for (uint32_t s = 0; s < nsegs; ++s)
+  {
+    if (seqs[s] != 0 && s != head && live[s] < best)
+    {
+      victim = s;
+      best = live[s];
+    }
+  }
+  if (victim == nsegs)
+  {
+    return false;
+  }
+  for (uint32_t slot = 0; slot < data_slots() && live[victim] > 0; ++slot)
+  {
+    uint32_t p = seg_first(victim) + sum_blocks + slot;
+    if (owner[p - seg_start] != 0 && !append(owner[p - seg_start], d->raw_block(p)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Write the map to the next checkpoint area. The head segment is closed
+// first, so whatever is written after the checkpoint is in a segment it
+// will roll forward through. Called with m held exclusively.
+void segment_log::write_checkpoint()
+{
+  if (head != nsegs && live[head] == 0)
+  {
+    retire(head);
+  }
+  head = nsegs;
+  uint32_t area = ckpt_start + ckpt_next * ckpt_len;
+  // the blocks the map points at, then the map, then its header
+  d->sync_range(seg_start, nsegs * seg_blocks);
+  memcpy(d->raw_block(area + 1), map.data(), (size_t)nblocks * sizeof(uint32_t));
+  d->sync_range(area + 1, ckpt_len - 1);
+  char buf[MAX_BLOCK_SIZE] = {0};
+  struct checkpoint_header h = {CKPT_MAGIC, next_seq, nblocks};
+  memcpy(buf, &h, sizeof(h));
+  memcpy(d->raw_block(area), buf, block_size);
+  d->sync_range(area, 1);
+  ckpt_next ^= 1;
+  opened = 0;
+}
+
+// Keep an eighth of the segments free, cleaning a segment at a time so
+// writers are not held up for long, and checkpoint once a quarter of the
+// segments would have to be rolled forward.
+void segment_log::clean_loop()
+{
+  std::unique_lock<std::mutex> lock(stop_m);
+  while (!stopping)
+  {
+    stop_cv.wait_for(lock, std::chrono::milliseconds(CLEAN_MS));
+    if (stopping)
+    {
+      break;
+    }
+    lock.unlock();
+    for (bool more = true; more;)
+    {
+      std::unique_lock<std::shared_mutex> w(m);
+      more = false;
+      size_t spare = free_segs.size() + cleaned.size() + synced.size();
+      if (!cleaning && spare < std::max(nsegs / 8, (uint32_t)SEG_RESERVE + 1))
+      {
+        cleaning = true;
+        more = clean_one();
+        cleaning = false;
+      }
+    }
+    {
+      std::unique_lock<std::shared_mutex> w(m);
+      if (opened >= nsegs / 4)
+      {
+        write_checkpoint();
+        release_cleaned();
+      }
+    }
+    lock.lock();
+  }
+}
@@ -0,0 +1,127 @@
+// log-structured block placement interface.
+
+#ifndef segment_log_h
+#define segment_log_h
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+class disk;
+struct superblock;
+
+#define SEG_MAGIC 0x7365676d  // "segm"
+#define CKPT_MAGIC 0x636b7074 // "ckpt"
+
+// Share of the segment area the file system may fill, in percent. The
+// rest is slack that lets the cleaner find mostly dead segments.
+#define SEG_FILL 80
+
+// Free segments kept back for the cleaner to copy into.
+#define SEG_RESERVE 2
+
+// How often the cleaner looks for work.
+#define CLEAN_MS 100
+
+// Head of each segment. It is followed by the home block number of every
+// data slot, in slot order, 0 for a slot not written yet; together they
+// take the first sum_blocks blocks of the segment.
+typedef struct seg_summary
+{
+  uint32_t magic;
+  uint32_t seq; // segments are numbered in the order they are opened
+} seg_summary_t;
+
+// Head of a checkpoint. It is followed by the whole block map.
+typedef struct checkpoint_header
+{
+  uint32_t magic;
+  uint32_t seq; // every segment opened since has a seq at least this
+  uint32_t nblocks;
+} checkpoint_header_t;
+
+// Log-structured placement of blocks. The blocks the file system sees are
+// logical; from `first` on, each lives wherever its latest copy was
+// written. Writes never go in place: every block is appended to the head
+// segment and the map is pointed at it, so scattered updates of inode,
+// bitmap and directory blocks reach the disk as one sequential stream.
+//
+// The map is checkpointed to one of two areas in turn. At mount the newer
+// checkpoint is loaded and rolled forward through the summaries of the
+// segments opened after it, oldest first.
+//
+// A cleaner thread keeps free segments around by copying the live blocks
+// of the emptiest segments to the head. A segment it empties is only
+// reused once the copies are safely on disk and a journal commit or a
+// checkpoint has made the frees that emptied it durable. Writers clean
+// for themselves if the cleaner falls behind.
+class segment_log
+{
+private:
+  disk *d;
+  uint32_t block_size;
+  uint32_t first;   // first logical block that is mapped
+  uint32_t nblocks; // logical blocks
+  uint32_t ckpt_start;
+  uint32_t ckpt_len;
+  uint32_t seg_start;
+  uint32_t seg_blocks;
+  uint32_t nsegs;
+  uint32_t sum_blocks; // summary blocks at the start of each segment
+
+  std::shared_mutex m;
+  std::vector<uint32_t> map;   // logical -> disk block, 0 if never written
+  std::vector<uint32_t> owner; // segment area slot -> logical, 0 if dead
+  std::vector<uint32_t> live;  // live blocks per segment
+  std::vector<uint32_t> seqs;  // per segment, 0 if it is free
+  std::vector<uint32_t> free_segs;
+  std::vector<uint32_t> cleaned; // emptied, free after the next sync commits
+  std::vector<uint32_t> synced;  // emptied before the sync under way
+  std::vector<uint32_t> written; // segments written to since the last flush
+  uint32_t head;                 // segment being filled, nsegs if none
+  uint32_t next_slot;
+  uint32_t next_seq;
+  uint32_t ckpt_next; // area the next checkpoint goes to
+  uint32_t opened;    // segments opened since the last checkpoint
+  bool cleaning;
+
+  std::mutex stop_m;
+  std::condition_variable stop_cv;
+  bool stopping;
+  std::thread cleaner;
+
+  uint32_t data_slots() const { return seg_blocks - sum_blocks; }
+  uint32_t seg_first(uint32_t s) const { return seg_start + s * seg_blocks; }
+  uint32_t *entries(uint32_t s) const;
+  bool open_segment();
+  void retire(uint32_t s);
+  void kill(uint32_t pblk);
+  bool append(uint32_t id, const char *buf);
+  bool clean_one();
+  void write_checkpoint();
+  void release_cleaned();
+  void clean_loop();
+
+public:
+  segment_log(disk *d, const struct superblock &sb);
+  ~segment_log();
+  static uint32_t summary_blocks(uint32_t seg_blocks, uint32_t block_size);
+  void format();
+  bool load();
+  void discard_free(const uint64_t *bitmap, uint32_t from);
+  void start_cleaner();
+  bool mapped(uint32_t id) const { return id >= first; }
+  void read(uint32_t id, uint32_t n, char *buf);
+  bool write(uint32_t id, uint32_t n, const char *buf);
+  void discard(uint32_t id);
+  void checkpoint();
+  void syncing();
+  void flush();
+  void committed();
+};
+
+#endif